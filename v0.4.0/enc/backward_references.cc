@@ -9,144 +9,17 @@
 #include "./backward_references.h"
 
 #include <algorithm>
+#include <cstdlib>
 #include <limits>
 #include <vector>
 
 #include "./command.h"
-#include "./fast_log.h"
-#include "./literal_cost.h"
 
 namespace brotli {
 
 // The maximum length for which the zopflification uses distinct distances.
 static const uint16_t kMaxZopfliLen = 325;
 
-// Histogram based cost model for zopflification.
-class ZopfliCostModel {
- public:
-  ZopfliCostModel(void) : min_cost_cmd_(kInfinity) {}
-
-  void SetFromCommands(size_t num_bytes,
-                       size_t position,
-                       const uint8_t* ringbuffer,
-                       size_t ringbuffer_mask,
-                       const Command* commands,
-                       size_t num_commands,
-                       size_t last_insert_len) {
-    std::vector<uint32_t> histogram_literal(256, 0);
-    std::vector<uint32_t> histogram_cmd(kNumCommandPrefixes, 0);
-    std::vector<uint32_t> histogram_dist(kNumDistancePrefixes, 0);
-
-    size_t pos = position - last_insert_len;
-    for (size_t i = 0; i < num_commands; i++) {
-      size_t inslength = commands[i].insert_len_;
-      size_t copylength = commands[i].copy_len();
-      size_t distcode = commands[i].dist_prefix_;
-      size_t cmdcode = commands[i].cmd_prefix_;
-
-      histogram_cmd[cmdcode]++;
-      if (cmdcode >= 128) histogram_dist[distcode]++;
-
-      for (size_t j = 0; j < inslength; j++) {
-        histogram_literal[ringbuffer[(pos + j) & ringbuffer_mask]]++;
-      }
-
-      pos += inslength + copylength;
-    }
-
-    std::vector<float> cost_literal;
-    Set(histogram_literal, &cost_literal);
-    Set(histogram_cmd, &cost_cmd_);
-    Set(histogram_dist, &cost_dist_);
-
-    for (uint32_t i = 0; i < kNumCommandPrefixes; ++i) {
-      min_cost_cmd_ = std::min(min_cost_cmd_, cost_cmd_[i]);
-    }
-
-    literal_costs_.resize(num_bytes + 1);
-    literal_costs_[0] = 0.0;
-    for (size_t i = 0; i < num_bytes; ++i) {
-      literal_costs_[i + 1] = literal_costs_[i] +
-          cost_literal[ringbuffer[(position + i) & ringbuffer_mask]];
-    }
-  }
-
-  void SetFromLiteralCosts(size_t num_bytes,
-                           size_t position,
-                           const uint8_t* ringbuffer,
-                           size_t ringbuffer_mask) {
-    literal_costs_.resize(num_bytes + 2);
-    EstimateBitCostsForLiterals(position, num_bytes, ringbuffer_mask,
-                                ringbuffer, &literal_costs_[1]);
-    literal_costs_[0] = 0.0;
-    for (size_t i = 0; i < num_bytes; ++i) {
-      literal_costs_[i + 1] += literal_costs_[i];
-    }
-    cost_cmd_.resize(kNumCommandPrefixes);
-    cost_dist_.resize(kNumDistancePrefixes);
-    for (uint32_t i = 0; i < kNumCommandPrefixes; ++i) {
-      cost_cmd_[i] = static_cast<float>(FastLog2(11 + i));
-    }
-    for (uint32_t i = 0; i < kNumDistancePrefixes; ++i) {
-      cost_dist_[i] = static_cast<float>(FastLog2(20 + i));
-    }
-    min_cost_cmd_ = static_cast<float>(FastLog2(11));
-  }
-
-  float GetCommandCost(
-      size_t dist_code, size_t length_code, size_t insert_length) const {
-    uint16_t inscode = GetInsertLengthCode(insert_length);
-    uint16_t copycode = GetCopyLengthCode(length_code);
-    uint16_t cmdcode = CombineLengthCodes(inscode, copycode, dist_code == 0);
-    uint16_t dist_symbol;
-    uint32_t distextra;
-    PrefixEncodeCopyDistance(dist_code, 0, 0, &dist_symbol, &distextra);
-    uint32_t distnumextra = distextra >> 24;
-
-    float result = static_cast<float>(
-        GetInsertExtra(inscode) + GetCopyExtra(copycode) + distnumextra);
-    result += cost_cmd_[cmdcode];
-    if (cmdcode >= 128) result += cost_dist_[dist_symbol];
-    return result;
-  }
-
-  float GetLiteralCosts(size_t from, size_t to) const {
-    return literal_costs_[to] - literal_costs_[from];
-  }
-
-  float GetMinCostCmd(void) const {
-    return min_cost_cmd_;
-  }
-
- private:
-  void Set(const std::vector<uint32_t>& histogram, std::vector<float>* cost) {
-    cost->resize(histogram.size());
-    size_t sum = 0;
-    for (size_t i = 0; i < histogram.size(); i++) {
-      sum += histogram[i];
-    }
-    float log2sum = static_cast<float>(FastLog2(sum));
-    for (size_t i = 0; i < histogram.size(); i++) {
-      if (histogram[i] == 0) {
-        (*cost)[i] = log2sum + 2;
-        continue;
-      }
-
-      // Shannon bits for this symbol.
-      (*cost)[i] = log2sum - static_cast<float>(FastLog2(histogram[i]));
-
-      // Cannot be coded with less than 1 bit
-      if ((*cost)[i] < 1) (*cost)[i] = 1;
-    }
-  }
-
-  std::vector<float> cost_cmd_;  // The insert and copy length symbols.
-  std::vector<float> cost_dist_;
-  // Cumulative costs of literals per position in the stream.
-  std::vector<float> literal_costs_;
-  float min_cost_cmd_;
-};
-
 inline size_t ComputeDistanceCode(size_t distance,
                                   size_t max_distance,
                                   int quality,
@@ -178,19 +51,6 @@ inline size_t ComputeDistanceCode(size_t distance,
   return distance + 15;
 }
 
-// REQUIRES: len >= 2, start_pos <= pos
-// REQUIRES: cost < kInfinity, nodes[start_pos].cost < kInfinity
-// Maintains the "ZopfliNode array invariant".
-inline void UpdateZopfliNode(ZopfliNode* nodes, size_t pos, size_t start_pos,
-                             size_t len, size_t len_code, size_t dist,
-                             size_t short_code, float cost) {
-  ZopfliNode& next = nodes[pos + len];
-  next.length = static_cast<uint32_t>(len | ((len + 9u - len_code) << 24));
-  next.distance = static_cast<uint32_t>(dist | (short_code << 25));
-  next.insert_length = static_cast<uint32_t>(pos - start_pos);
-  next.cost = cost;
-}
-
 // Maintains the smallest 2^k cost difference together with their positions
 class StartPosQueue {
  public:
@@ -237,19 +97,19 @@ class StartPosQueue {
 // Returns the minimum possible copy length that can improve the cost of any
 // future position.
 static size_t ComputeMinimumCopyLength(const StartPosQueue& queue,
-                                       const ZopfliNode* nodes,
+                                       const ZopfliNodes& nodes,
                                        const ZopfliCostModel& model,
                                        const size_t num_bytes,
                                        const size_t pos) {
   // Compute the minimum possible cost of reaching any future position.
   const size_t start0 = queue.GetStartPosData(0).pos;
-  float min_cost = (nodes[start0].cost +
+  float min_cost = (nodes.cost(start0) +
                     model.GetLiteralCosts(start0, pos) +
                     model.GetMinCostCmd());
   size_t len = 2;
   size_t next_len_bucket = 4;
   size_t next_len_offset = 10;
-  while (pos + len <= num_bytes && nodes[pos + len].cost <= min_cost) {
+  while (pos + len <= num_bytes && nodes.cost(pos + len) <= min_cost) {
     // We already reached (pos + len) with no more cost than the minimum
     // possible cost of reaching anything from this pos, so there is no point in
     // looking for lengths <= len.
@@ -270,13 +130,13 @@ static size_t ComputeMinimumCopyLength(const StartPosQueue& queue,
 // used the shortest path of commands from block_start, computed from
 // nodes[0..pos]. The last four distances at block_start are in
 // starting_dist_cach[0..3].
-// REQUIRES: nodes[pos].cost < kInfinity
+// REQUIRES: nodes.cost(pos) < kInfinity
 // REQUIRES: nodes[0..pos] satisfies that "ZopfliNode array invariant".
 static void ComputeDistanceCache(const size_t block_start,
                                  const size_t pos,
                                  const size_t max_backward,
                                  const int* starting_dist_cache,
-                                 const ZopfliNode* nodes,
+                                 const ZopfliNodes& nodes,
                                  int* dist_cache) {
   int idx = 0;
   size_t p = pos;
@@ -313,22 +173,22 @@ static void UpdateNodes(const size_t num_bytes,
                         const BackwardMatch* matches,
                         const ZopfliCostModel* model,
                         StartPosQueue* queue,
-                        ZopfliNode* nodes) {
+                        ZopfliNodes* nodes) {
   size_t cur_ix = block_start + pos;
   size_t cur_ix_masked = cur_ix & ringbuffer_mask;
   size_t max_distance = std::min(cur_ix, max_backward_limit);
 
-  if (nodes[pos].cost <= model->GetLiteralCosts(0, pos)) {
+  if (nodes->cost(pos) <= model->GetLiteralCosts(0, pos)) {
     StartPosQueue::PosData posdata;
     posdata.pos = pos;
-    posdata.costdiff = nodes[pos].cost - model->GetLiteralCosts(0, pos);
+    posdata.costdiff = nodes->cost(pos) - model->GetLiteralCosts(0, pos);
     ComputeDistanceCache(block_start, pos, max_backward_limit,
-                         starting_dist_cache, nodes, posdata.distance_cache);
+                         starting_dist_cache, *nodes, posdata.distance_cache);
     queue->Push(posdata);
   }
 
   const size_t min_len = ComputeMinimumCopyLength(
-      *queue, nodes, *model, num_bytes, pos);
+      *queue, *nodes, *model, num_bytes, pos);
 
   // Go over the command starting positions in order of increasing cost
   // difference.
@@ -367,8 +227,8 @@ static void UpdateNodes(const size_t num_bytes,
         const size_t inslen = pos - start;
         float cmd_cost = model->GetCommandCost(j, l, inslen);
         float cost = start_costdiff + cmd_cost + model->GetLiteralCosts(0, pos);
-        if (cost < nodes[pos + l].cost) {
-          UpdateZopfliNode(&nodes[0], pos, start, l, l, backward, j + 1, cost);
+        if (cost < nodes->cost(pos + l)) {
+          nodes->Update(pos, start, l, l, backward, j + 1, cost);
         }
         best_len = l;
       }
@@ -400,20 +260,27 @@ static void UpdateNodes(const size_t num_bytes,
         const size_t inslen = pos - start;
         float cmd_cost = model->GetCommandCost(dist_code, len_code, inslen);
         float cost = start_costdiff + cmd_cost + model->GetLiteralCosts(0, pos);
-        if (cost < nodes[pos + len].cost) {
-          UpdateZopfliNode(&nodes[0], pos, start, len, len_code, dist, 0, cost);
+        if (cost < nodes->cost(pos + len)) {
+          nodes->Update(pos, start, len, len_code, dist, 0, cost);
         }
       }
     }
   }
 }
 
+inline void PushDistance(size_t distance, int* dist_cache) {
+  dist_cache[3] = dist_cache[2];
+  dist_cache[2] = dist_cache[1];
+  dist_cache[1] = dist_cache[0];
+  dist_cache[0] = static_cast<int>(distance);
+}
+
 static void ComputeShortestPathFromNodes(size_t num_bytes,
-                                         const ZopfliNode* nodes,
+                                         const ZopfliNodes& nodes,
                                          std::vector<uint32_t>* path) {
   std::vector<uint32_t> backwards(num_bytes / 2 + 1);
   size_t index = num_bytes;
-  while (nodes[index].cost == kInfinity) --index;
+  while (nodes.cost(index) == kInfinity) --index;
   size_t num_commands = 0;
   while (index != 0) {
     size_t len = nodes[index].command_length();
@@ -430,11 +297,32 @@ void ZopfliCreateCommands(const size_t num_bytes,
                           const size_t block_start,
                           const size_t max_backward_limit,
                           const std::vector<uint32_t>& path,
-                          const ZopfliNode* nodes,
+                          const ZopfliNodes& nodes,
+                          int* dist_cache,
+                          size_t* last_insert_len,
+                          Command* commands,
+                          size_t* num_literals) {
+  ZopfliCreateCommands(num_bytes, block_start, max_backward_limit, path, nodes,
+                       dist_cache, dist_cache, last_insert_len, commands,
+                       num_literals);
+}
+
+void ZopfliCreateCommands(const size_t num_bytes,
+                          const size_t block_start,
+                          const size_t max_backward_limit,
+                          const std::vector<uint32_t>& path,
+                          const ZopfliNodes& nodes,
+                          const int* path_dist_cache,
                           int* dist_cache,
                           size_t* last_insert_len,
                           Command* commands,
                           size_t* num_literals) {
+  // The last distances as seen by the shortest path search. As long as they
+  // differ from the actual ones, the distance codes of the nodes can not be
+  // used as they are.
+  int path_cache[4];
+  memcpy(path_cache, path_dist_cache, sizeof(path_cache));
+  bool in_sync = memcmp(path_cache, dist_cache, sizeof(path_cache)) == 0;
   size_t pos = 0;
   for (size_t i = 0; i < path.size(); i++) {
     const ZopfliNode& next = nodes[pos + path[i]];
@@ -450,15 +338,22 @@ void ZopfliCreateCommands(const size_t num_bytes,
     size_t max_distance = std::min(block_start + pos, max_backward_limit);
     bool is_dictionary = (distance > max_distance);
     size_t dist_code = next.distance_code();
+    if (!in_sync && !is_dictionary) {
+      if (dist_code > 0) {
+        PushDistance(distance, path_cache);
+      }
+      // Zopfli is only used above quality 9.
+      dist_code = ComputeDistanceCode(distance, max_distance, 10, dist_cache);
+    }
 
     Command cmd(insert_length, copy_length, len_code, dist_code);
     commands[i] = cmd;
 
     if (!is_dictionary && dist_code > 0) {
-      dist_cache[3] = dist_cache[2];
-      dist_cache[2] = dist_cache[1];
-      dist_cache[1] = dist_cache[0];
-      dist_cache[0] = static_cast<int>(distance);
+      PushDistance(distance, dist_cache);
+    }
+    if (!in_sync) {
+      in_sync = memcmp(path_cache, dist_cache, sizeof(path_cache)) == 0;
     }
 
     *num_literals += insert_length;
@@ -467,6 +362,55 @@ void ZopfliCreateCommands(const size_t num_bytes,
   *last_insert_len += num_bytes - pos;
 }
 
+void RecomputeDistanceCodes(size_t position,
+                            const size_t max_backward_limit,
+                            const int quality,
+                            const int* assumed_dist_cache,
+                            size_t num_commands,
+                            Command* commands,
+                            int* dist_cache) {
+  int assumed_cache[4];
+  memcpy(assumed_cache, assumed_dist_cache, sizeof(assumed_cache));
+  bool in_sync = memcmp(assumed_cache, dist_cache, sizeof(assumed_cache)) == 0;
+  for (size_t i = 0; i < num_commands; ++i) {
+    Command* cmd = &commands[i];
+    position += cmd->insert_len_;
+    const size_t copy_length = cmd->copy_len();
+    if (copy_length == 0) {
+      // Insert-only command at the end of the meta-block.
+      continue;
+    }
+    const size_t max_distance = std::min(position, max_backward_limit);
+    const size_t dist_code = cmd->DistanceCode();
+    size_t distance = dist_code - 15;
+    if (dist_code < kNumDistanceShortCodes) {
+      distance = static_cast<size_t>(
+          assumed_cache[kDistanceCacheIndex[dist_code]] +
+          kDistanceCacheOffset[dist_code]);
+    }
+    const bool is_dictionary = distance > max_distance;
+    size_t new_dist_code = dist_code;
+    if (!in_sync && !is_dictionary) {
+      new_dist_code =
+          ComputeDistanceCode(distance, max_distance, quality, dist_cache);
+      if (new_dist_code != dist_code) {
+        *cmd = Command(cmd->insert_len_, copy_length, cmd->copy_len_code(),
+                       new_dist_code);
+      }
+    }
+    if (!is_dictionary && dist_code > 0) {
+      PushDistance(distance, assumed_cache);
+    }
+    if (!is_dictionary && new_dist_code > 0) {
+      PushDistance(distance, dist_cache);
+    }
+    if (!in_sync) {
+      in_sync = memcmp(assumed_cache, dist_cache, sizeof(assumed_cache)) == 0;
+    }
+    position += copy_length;
+  }
+}
+
 static void ZopfliIterate(size_t num_bytes,
                           size_t position,
                           const uint8_t* ringbuffer,
@@ -476,16 +420,15 @@ static void ZopfliIterate(size_t num_bytes,
                           const ZopfliCostModel& model,
                           const std::vector<uint32_t>& num_matches,
                           const std::vector<BackwardMatch>& matches,
-                          ZopfliNode* nodes,
+                          ZopfliNodes* nodes,
                           std::vector<uint32_t>* path) {
-  nodes[0].length = 0;
-  nodes[0].cost = 0;
+  nodes->Init(num_bytes);
   StartPosQueue queue(3);
   size_t cur_match_pos = 0;
   for (size_t i = 0; i + 3 < num_bytes; i++) {
     UpdateNodes(num_bytes, position, i, ringbuffer, ringbuffer_mask,
                 max_backward_limit, dist_cache, num_matches[i],
-                &matches[cur_match_pos], &model, &queue, &nodes[0]);
+                &matches[cur_match_pos], &model, &queue, nodes);
     cur_match_pos += num_matches[i];
     // The zopflification can be too slow in case of very long lengths, so in
     // such case skip it all, it does not cost a lot of compression ratio.
@@ -495,10 +438,33 @@ static void ZopfliIterate(size_t num_bytes,
       queue.Clear();
     }
   }
-  ComputeShortestPathFromNodes(num_bytes, &nodes[0], path);
+  ComputeShortestPathFromNodes(num_bytes, *nodes, path);
 }
 
 
+// With prefetching enabled, the hash key of the position this many bytes
+// ahead is computed, and the cache lines it needs are loaded in two steps,
+// see PrefetchKey() and PrefetchBucket() of the hashers, so that the memory
+// latency overlaps the match search at the positions in between.
+static const size_t kKeyPrefetchDistance = 16;
+static const size_t kBucketPrefetchDistance = 8;
+
+// Prefetches the tree roots of the positions ahead of position + i of the
+// block for the H10 match search.
+static inline void PrefetchTreeMatches(size_t num_bytes,
+                                       size_t position,
+                                       size_t i,
+                                       const uint8_t* ringbuffer,
+                                       size_t ringbuffer_mask,
+                                       const Hashers::H10* hasher) {
+  if (i + kKeyPrefetchDistance + 4 <= num_bytes) {
+    const uint8_t* data = &ringbuffer[(position + i) & ringbuffer_mask];
+    hasher->PrefetchKey(&data[kKeyPrefetchDistance]);
+    hasher->PrefetchBucket(&data[kBucketPrefetchDistance], ringbuffer,
+                           ringbuffer_mask);
+  }
+}
+
 void ZopfliComputeShortestPath(size_t num_bytes,
                                size_t position,
                                const uint8_t* ringbuffer,
@@ -506,16 +472,17 @@ void ZopfliComputeShortestPath(size_t num_bytes,
                                const size_t max_backward_limit,
                                const int* dist_cache,
                                Hashers::H10* hasher,
-                               ZopfliNode* nodes,
+                               ZopfliCostModel* model,
+                               ZopfliNodes* nodes,
                                std::vector<uint32_t>* path) {
-  nodes[0].length = 0;
-  nodes[0].cost = 0;
-  ZopfliCostModel* model = new ZopfliCostModel;
+  nodes->Init(num_bytes);
   model->SetFromLiteralCosts(num_bytes, position,
                              ringbuffer, ringbuffer_mask);
   StartPosQueue queue(3);
   BackwardMatch matches[Hashers::H10::kMaxNumMatches];
   for (size_t i = 0; i + 3 < num_bytes; i++) {
+    PrefetchTreeMatches(num_bytes, position, i, ringbuffer, ringbuffer_mask,
+                        hasher);
     const size_t max_distance = std::min(position + i, max_backward_limit);
     size_t num_matches = hasher->FindAllMatches(
         ringbuffer, ringbuffer_mask, position + i, num_bytes - i, max_distance,
@@ -539,8 +506,96 @@ void ZopfliComputeShortestPath(size_t num_bytes,
       queue.Clear();
     }
   }
-  delete model;
-  ComputeShortestPathFromNodes(num_bytes, nodes, path);
+  ComputeShortestPathFromNodes(num_bytes, *nodes, path);
+}
+
+void ZopfliFindAllMatches(size_t num_bytes,
+                          size_t position,
+                          const uint8_t* ringbuffer,
+                          size_t ringbuffer_mask,
+                          const size_t max_backward_limit,
+                          Hashers::H10* hasher,
+                          std::vector<uint32_t>* num_matches_out,
+                          std::vector<BackwardMatch>* matches_out) {
+  std::vector<uint32_t>& num_matches = *num_matches_out;
+  std::vector<BackwardMatch>& matches = *matches_out;
+  num_matches.resize(num_bytes);
+  matches.resize(4 * num_bytes);
+  size_t cur_match_pos = 0;
+  for (size_t i = 0; i + 3 < num_bytes; ++i) {
+    PrefetchTreeMatches(num_bytes, position, i, ringbuffer, ringbuffer_mask,
+                        hasher);
+    size_t max_distance = std::min(position + i, max_backward_limit);
+    size_t max_length = num_bytes - i;
+    // Ensure that we have enough free slots.
+    if (matches.size() < cur_match_pos + Hashers::H10::kMaxNumMatches) {
+      matches.resize(cur_match_pos + Hashers::H10::kMaxNumMatches);
+    }
+    size_t num_found_matches = hasher->FindAllMatches(
+        ringbuffer, ringbuffer_mask, position + i, max_length, max_distance,
+        &matches[cur_match_pos]);
+    const size_t cur_match_end = cur_match_pos + num_found_matches;
+    for (size_t j = cur_match_pos; j + 1 < cur_match_end; ++j) {
+      assert(matches[j].length() < matches[j + 1].length());
+      assert(matches[j].distance > max_distance ||
+             matches[j].distance <= matches[j + 1].distance);
+    }
+    num_matches[i] = static_cast<uint32_t>(num_found_matches);
+    if (num_found_matches > 0) {
+      const size_t match_len = matches[cur_match_end - 1].length();
+      if (match_len > kMaxZopfliLen) {
+        matches[cur_match_pos++] = matches[cur_match_end - 1];
+        num_matches[i] = 1;
+        for (size_t j = 1; j < match_len; ++j) {
+          ++i;
+          if (match_len - j < 64 && num_bytes - i >= kMaxTreeCompLength) {
+            hasher->Store(ringbuffer, ringbuffer_mask, position + i);
+          }
+          num_matches[i] = 0;
+        }
+      } else {
+        cur_match_pos = cur_match_end;
+      }
+    }
+  }
+}
+
+void ZopfliComputeShortestPath(size_t num_bytes,
+                               size_t position,
+                               const uint8_t* ringbuffer,
+                               size_t ringbuffer_mask,
+                               const size_t max_backward_limit,
+                               const int* dist_cache,
+                               const size_t num_iterations,
+                               const std::vector<uint32_t>& num_matches,
+                               const std::vector<BackwardMatch>& matches,
+                               ZopfliCostModel* model,
+                               ZopfliNodes* nodes,
+                               std::vector<uint32_t>* path) {
+  model->SetFromLiteralCosts(num_bytes, position, ringbuffer, ringbuffer_mask);
+  for (size_t i = 0; ; ++i) {
+    ZopfliIterate(num_bytes, position, ringbuffer, ringbuffer_mask,
+                  max_backward_limit, dist_cache, *model, num_matches, matches,
+                  nodes, path);
+    if (i + 1 >= num_iterations) {
+      break;
+    }
+    // Compute the cost model of the next iteration from the commands of this
+    // one.
+    Command* commands = static_cast<Command*>(
+        malloc(sizeof(Command) * (path->size() + 1)));
+    int commands_dist_cache[4] = {
+      dist_cache[0], dist_cache[1], dist_cache[2], dist_cache[3]
+    };
+    size_t last_insert_len = 0;
+    size_t num_literals = 0;
+    ZopfliCreateCommands(num_bytes, position, max_backward_limit, *path,
+                         *nodes, commands_dist_cache, &last_insert_len,
+                         commands, &num_literals);
+    model->SetFromCommands(num_bytes, position, ringbuffer, ringbuffer_mask,
+                           commands, path->size(), 0);
+    free(commands);
+  }
 }
 
 template<typename Hasher>
@@ -552,6 +607,8 @@ void CreateBackwardReferences(size_t num_bytes,
                               const int quality,
                               const int lgwin,
                               Hasher* hasher,
+                              const bool prefetch,
+                              HashLongDistance* long_hasher,
                               int* dist_cache,
                               size_t* last_insert_len,
                               Command* commands,
@@ -579,6 +636,10 @@ void CreateBackwardReferences(size_t num_bytes,
     hasher->Store(&ringbuffer[(position - 1) & ringbuffer_mask],
                   static_cast<uint32_t>(position - 1));
   }
+  if (long_hasher != NULL) {
+    long_hasher->FindMatchesInBlock(num_bytes, position, ringbuffer,
+                                    ringbuffer_mask, max_backward_limit);
+  }
   const Command * const orig_commands = commands;
   size_t insert_length = *last_insert_len;
   size_t i = position & ringbuffer_mask;
@@ -593,6 +654,10 @@ void CreateBackwardReferences(size_t num_bytes,
   const double kMinScore = 4.0;
 
   while (i + Hasher::kHashTypeLength - 1 < i_end) {
+    if (prefetch && i + kKeyPrefetchDistance + 8 <= i_end) {
+      hasher->PrefetchKey(&ringbuffer[i + kKeyPrefetchDistance]);
+      hasher->PrefetchBucket(&ringbuffer[i + kBucketPrefetchDistance]);
+    }
     size_t max_length = i_end - i;
     size_t max_distance = std::min(i + i_diff, max_backward_limit);
     size_t best_len = 0;
@@ -603,6 +668,12 @@ void CreateBackwardReferences(size_t num_bytes,
         ringbuffer, ringbuffer_mask,
         dist_cache, static_cast<uint32_t>(i + i_diff), max_length, max_distance,
         &best_len, &best_len_code, &best_dist, &best_score);
+    if (long_hasher != NULL &&
+        long_hasher->FindLongestMatch(i + i_diff, max_distance, &best_len,
+                                      &best_len_code, &best_dist,
+                                      &best_score)) {
+      match_found = true;
+    }
     if (match_found) {
       // Found a match. Let's look for something even better ahead.
       int delayed_backward_references_in_row = 0;
@@ -717,64 +788,32 @@ void CreateBackwardReferences(size_t num_bytes,
     // Set maximum distance, see section 9.1. of the spec.
     const size_t max_backward_limit = (1 << lgwin) - 16;
     if (quality == 10) {
-      std::vector<ZopfliNode> nodes(num_bytes + 1);
       std::vector<uint32_t> path;
       ZopfliComputeShortestPath(num_bytes, position,
                                 ringbuffer, ringbuffer_mask,
                                 max_backward_limit, dist_cache, hasher,
-                                &nodes[0], &path);
+                                hashers->zopfli_cost_model,
+                                hashers->zopfli_nodes, &path);
       ZopfliCreateCommands(num_bytes, position, max_backward_limit, path,
-                           &nodes[0], dist_cache, last_insert_len, commands,
+                           *hashers->zopfli_nodes, dist_cache, last_insert_len, commands,
                            num_literals);
       *num_commands += path.size();
       return;
     }
-    std::vector<uint32_t> num_matches(num_bytes);
-    std::vector<BackwardMatch> matches(4 * num_bytes);
-    size_t cur_match_pos = 0;
-    for (size_t i = 0; i + 3 < num_bytes; ++i) {
-      size_t max_distance = std::min(position + i, max_backward_limit);
-      size_t max_length = num_bytes - i;
-      // Ensure that we have enough free slots.
-      if (matches.size() < cur_match_pos + Hashers::H10::kMaxNumMatches) {
-        matches.resize(cur_match_pos + Hashers::H10::kMaxNumMatches);
-      }
-      size_t num_found_matches = hasher->FindAllMatches(
-          ringbuffer, ringbuffer_mask, position + i, max_length, max_distance,
-          &matches[cur_match_pos]);
-      const size_t cur_match_end = cur_match_pos + num_found_matches;
-      for (size_t j = cur_match_pos; j + 1 < cur_match_end; ++j) {
-        assert(matches[j].length() < matches[j + 1].length());
-        assert(matches[j].distance > max_distance ||
-               matches[j].distance <= matches[j + 1].distance);
-      }
-      num_matches[i] = static_cast<uint32_t>(num_found_matches);
-      if (num_found_matches > 0) {
-        const size_t match_len = matches[cur_match_end - 1].length();
-        if (match_len > kMaxZopfliLen) {
-          matches[cur_match_pos++] = matches[cur_match_end - 1];
-          num_matches[i] = 1;
-          for (size_t j = 1; j < match_len; ++j) {
-            ++i;
-            if (match_len - j < 64 && num_bytes - i >= kMaxTreeCompLength) {
-              hasher->Store(ringbuffer, ringbuffer_mask, position + i);
-            }
-            num_matches[i] = 0;
-          }
-        } else {
-          cur_match_pos = cur_match_end;
-        }
-      }
-    }
+    std::vector<uint32_t> num_matches;
+    std::vector<BackwardMatch> matches;
+    ZopfliFindAllMatches(num_bytes, position, ringbuffer, ringbuffer_mask,
+                         max_backward_limit, hasher, &num_matches, &matches);
     size_t orig_num_literals = *num_literals;
     size_t orig_last_insert_len = *last_insert_len;
     int orig_dist_cache[4] = {
       dist_cache[0], dist_cache[1], dist_cache[2], dist_cache[3]
     };
     size_t orig_num_commands = *num_commands;
+    ZopfliCostModel& model = *hashers->zopfli_cost_model;
+    ZopfliNodes* nodes = hashers->zopfli_nodes;
     static const size_t kIterations = 2;
     for (size_t i = 0; i < kIterations; i++) {
-      ZopfliCostModel model;
       if (i == 0) {
         model.SetFromLiteralCosts(num_bytes, position,
                                   ringbuffer, ringbuffer_mask);
@@ -788,13 +827,12 @@ void CreateBackwardReferences(size_t num_bytes,
       *num_literals = orig_num_literals;
       *last_insert_len = orig_last_insert_len;
       memcpy(dist_cache, orig_dist_cache, 4 * sizeof(dist_cache[0]));
-      std::vector<ZopfliNode> nodes(num_bytes + 1);
       std::vector<uint32_t> path;
       ZopfliIterate(num_bytes, position, ringbuffer, ringbuffer_mask,
                     max_backward_limit, dist_cache, model, num_matches, matches,
-                    &nodes[0], &path);
+                    nodes, &path);
       ZopfliCreateCommands(num_bytes, position, max_backward_limit, path,
-                           &nodes[0], dist_cache, last_insert_len, commands,
+                           *nodes, dist_cache, last_insert_len, commands,
                            num_literals);
       *num_commands += path.size();
     }
@@ -805,49 +843,57 @@ void CreateBackwardReferences(size_t num_bytes,
     case 2:
       CreateBackwardReferences<Hashers::H2>(
           num_bytes, position, is_last, ringbuffer, ringbuffer_mask,
-          quality, lgwin, hashers->hash_h2, dist_cache,
+          quality, lgwin, hashers->hash_h2,
+          hashers->prefetch_buckets, hashers->hash_long_distance, dist_cache,
           last_insert_len, commands, num_commands, num_literals);
       break;
     case 3:
       CreateBackwardReferences<Hashers::H3>(
           num_bytes, position, is_last, ringbuffer, ringbuffer_mask,
-          quality, lgwin, hashers->hash_h3, dist_cache,
+          quality, lgwin, hashers->hash_h3,
+          hashers->prefetch_buckets, hashers->hash_long_distance, dist_cache,
           last_insert_len, commands, num_commands, num_literals);
       break;
     case 4:
       CreateBackwardReferences<Hashers::H4>(
           num_bytes, position, is_last, ringbuffer, ringbuffer_mask,
-          quality, lgwin, hashers->hash_h4, dist_cache,
+          quality, lgwin, hashers->hash_h4,
+          hashers->prefetch_buckets, hashers->hash_long_distance, dist_cache,
           last_insert_len, commands, num_commands, num_literals);
       break;
     case 5:
       CreateBackwardReferences<Hashers::H5>(
           num_bytes, position, is_last, ringbuffer, ringbuffer_mask,
-          quality, lgwin, hashers->hash_h5, dist_cache,
+          quality, lgwin, hashers->hash_h5,
+          hashers->prefetch_buckets, hashers->hash_long_distance, dist_cache,
           last_insert_len, commands, num_commands, num_literals);
       break;
     case 6:
       CreateBackwardReferences<Hashers::H6>(
           num_bytes, position, is_last, ringbuffer, ringbuffer_mask,
-          quality, lgwin, hashers->hash_h6, dist_cache,
+          quality, lgwin, hashers->hash_h6,
+          hashers->prefetch_buckets, hashers->hash_long_distance, dist_cache,
           last_insert_len, commands, num_commands, num_literals);
       break;
     case 7:
       CreateBackwardReferences<Hashers::H7>(
           num_bytes, position, is_last, ringbuffer, ringbuffer_mask,
-          quality, lgwin, hashers->hash_h7, dist_cache,
+          quality, lgwin, hashers->hash_h7,
+          hashers->prefetch_buckets, hashers->hash_long_distance, dist_cache,
           last_insert_len, commands, num_commands, num_literals);
       break;
     case 8:
       CreateBackwardReferences<Hashers::H8>(
           num_bytes, position, is_last, ringbuffer, ringbuffer_mask,
-          quality, lgwin, hashers->hash_h8, dist_cache,
+          quality, lgwin, hashers->hash_h8,
+          hashers->prefetch_buckets, hashers->hash_long_distance, dist_cache,
           last_insert_len, commands, num_commands, num_literals);
       break;
     case 9:
       CreateBackwardReferences<Hashers::H9>(
           num_bytes, position, is_last, ringbuffer, ringbuffer_mask,
-          quality, lgwin, hashers->hash_h9, dist_cache,
+          quality, lgwin, hashers->hash_h9,
+          hashers->prefetch_buckets, hashers->hash_long_distance, dist_cache,
           last_insert_len, commands, num_commands, num_literals);
       break;
     default:
@@ -14,6 +14,8 @@
 #include "./hash.h"
 #include "./command.h"
 #include "./types.h"
+#include "./zopfli_cost_model.h"
+#include "./zopfli_node.h"
 
 namespace brotli {
 
@@ -36,61 +38,33 @@ void CreateBackwardReferences(size_t num_bytes,
                               size_t* num_commands,
                               size_t* num_literals);
 
-static const float kInfinity = std::numeric_limits<float>::infinity();
-
-struct ZopfliNode {
-  ZopfliNode(void) : length(1),
-                     distance(0),
-                     insert_length(0),
-                     cost(kInfinity) {}
-
-  inline uint32_t copy_length() const {
-    return length & 0xffffff;
-  }
-
-  inline uint32_t length_code() const {
-    const uint32_t modifier = length >> 24;
-    return copy_length() + 9u - modifier;
-  }
-
-  inline uint32_t copy_distance() const {
-    return distance & 0x1ffffff;
-  }
-
-  inline uint32_t distance_code() const {
-    const uint32_t short_code = distance >> 25;
-    return short_code == 0 ? copy_distance() + 15 : short_code - 1;
-  }
-
-  inline uint32_t command_length() const {
-    return copy_length() + insert_length;
-  }
-
-  // best length to get up to this byte (not including this byte itself)
-  // highest 8 bit is used to reconstruct the length code
-  uint32_t length;
-  // distance associated with the length
-  // highest 7 bit contains distance short code + 1 (or zero if no short code)
-  uint32_t distance;
-  // number of literal inserts before this copy
-  uint32_t insert_length;
-  // smallest cost to get to this byte from the beginning, as found so far
-  float cost;
-};
+// Recomputes the distance codes of commands that were created with
+// assumed_dist_cache as the last four distances at position, for the actual
+// last distances in dist_cache. Only the commands before the two distance
+// caches agree can change. On return, dist_cache holds the last distances
+// after the commands.
+void RecomputeDistanceCodes(size_t position,
+                            const size_t max_backward_limit,
+                            const int quality,
+                            const int* assumed_dist_cache,
+                            size_t num_commands,
+                            Command* commands,
+                            int* dist_cache);
 
 // Computes the shortest path of commands from position to at most
-// position + num_bytes.
+// position + num_bytes. The model is set up for the block and can be reused
+// for the next ones.
 //
 // On return, path->size() is the number of commands found and path[i] is the
 // length of the ith command (copy length plus insert length).
 // Note that the sum of the lengths of all commands can be less than num_bytes.
 //
-// On return, the nodes[0..num_bytes] array will have the following
+// On return, nodes[0..num_bytes] will have the following
 // "ZopfliNode array invariant":
-// For each i in [1..num_bytes], if nodes[i].cost < kInfinity, then
-//   (1) nodes[i].copy_length() >= 2
-//   (2) nodes[i].command_length() <= i and
-//   (3) nodes[i - nodes[i].command_length()].cost < kInfinity
+// For each i in [1..num_bytes], if nodes->cost(i) < kInfinity, then
+//   (1) (*nodes)[i].copy_length() >= 2
+//   (2) (*nodes)[i].command_length() <= i and
+//   (3) nodes->cost(i - (*nodes)[i].command_length()) < kInfinity
 void ZopfliComputeShortestPath(size_t num_bytes,
                                size_t position,
                                const uint8_t* ringbuffer,
@@ -98,14 +72,61 @@ void ZopfliComputeShortestPath(size_t num_bytes,
                                const size_t max_backward_limit,
                                const int* dist_cache,
                                Hashers::H10* hasher,
-                               ZopfliNode* nodes,
+                               ZopfliCostModel* model,
+                               ZopfliNodes* nodes,
                                std::vector<uint32_t>* path);
 
+// Finds all matches of the positions in [position, position + num_bytes) and
+// adds the positions to the hasher. On return, num_matches[i] is the number of
+// matches of the ith position, and they are stored in matches after the ones
+// of the previous positions. Positions that are covered by a long match of an
+// earlier position have no matches.
+void ZopfliFindAllMatches(size_t num_bytes,
+                          size_t position,
+                          const uint8_t* ringbuffer,
+                          size_t ringbuffer_mask,
+                          const size_t max_backward_limit,
+                          Hashers::H10* hasher,
+                          std::vector<uint32_t>* num_matches,
+                          std::vector<BackwardMatch>* matches);
+
+// Same as above, but uses the matches found by ZopfliFindAllMatches() instead
+// of a hasher, so it can run concurrently for different blocks. Every
+// iteration after the first one uses a cost model computed from the commands
+// of the previous iteration.
+void ZopfliComputeShortestPath(size_t num_bytes,
+                               size_t position,
+                               const uint8_t* ringbuffer,
+                               size_t ringbuffer_mask,
+                               const size_t max_backward_limit,
+                               const int* dist_cache,
+                               const size_t num_iterations,
+                               const std::vector<uint32_t>& num_matches,
+                               const std::vector<BackwardMatch>& matches,
+                               ZopfliCostModel* model,
+                               ZopfliNodes* nodes,
+                               std::vector<uint32_t>* path);
+
+void ZopfliCreateCommands(const size_t num_bytes,
+                          const size_t block_start,
+                          const size_t max_backward_limit,
+                          const std::vector<uint32_t>& path,
+                          const ZopfliNodes& nodes,
+                          int* dist_cache,
+                          size_t* last_insert_len,
+                          Command* commands,
+                          size_t* num_literals);
+
+// Same as above, but the shortest path was computed with path_dist_cache as
+// the last four distances at block_start, which can differ from the actual
+// ones in dist_cache. The distance codes of the first commands are then
+// recomputed from their distances, until the two distance caches agree.
 void ZopfliCreateCommands(const size_t num_bytes,
                           const size_t block_start,
                           const size_t max_backward_limit,
                           const std::vector<uint32_t>& path,
-                          const ZopfliNode* nodes,
+                          const ZopfliNodes& nodes,
+                          const int* path_dist_cache,
                           int* dist_cache,
                           size_t* last_insert_len,
                           Command* commands,
@@ -0,0 +1,167 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+   Distributed under MIT license.
+   See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+*/
+
+// SIMD versions of FindNonZeroCounts for the entropy estimates.
+
+#include "./bit_cost.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define BROTLI_BIT_COST_SIMD
+#include <immintrin.h>
+#endif
+
+namespace brotli {
+
+namespace {
+
+// Appends the counts a[i] + b[i] for i in [start, end) that are not zero,
+// or a[i] if b is NULL.
+inline size_t AppendNonZeroCounts(const uint32_t* a,
+                                  const uint32_t* b,
+                                  size_t start,
+                                  size_t end,
+                                  size_t num_nonzero,
+                                  uint16_t* symbols,
+                                  uint32_t* counts) {
+  for (size_t i = start; i < end; ++i) {
+    const uint32_t count = b == NULL ? a[i] : a[i] + b[i];
+    if (count != 0) {
+      symbols[num_nonzero] = static_cast<uint16_t>(i);
+      counts[num_nonzero] = count;
+      ++num_nonzero;
+    }
+  }
+  return num_nonzero;
+}
+
+#ifdef BROTLI_BIT_COST_SIMD
+
+typedef size_t (*FindNonZeroCountsFunc)(const uint32_t* a,
+                                        const uint32_t* b,
+                                        size_t size,
+                                        uint16_t* symbols,
+                                        uint32_t* counts);
+
+// Lanes of the nonzero counts for each mask of 8 lanes, in order, followed
+// by zeros.
+uint8_t nonzero_lanes[256][8];
+
+void InitNonZeroLanes(void) {
+  for (uint32_t mask = 0; mask < 256; ++mask) {
+    size_t num_lanes = 0;
+    for (uint8_t lane = 0; lane < 8; ++lane) {
+      if ((mask >> lane) & 1) {
+        nonzero_lanes[mask][num_lanes++] = lane;
+      }
+    }
+    while (num_lanes < 8) {
+      nonzero_lanes[mask][num_lanes++] = 0;
+    }
+  }
+}
+
+// The loops test whole vectors of counts, the rest is left to the scalar
+// version.
+
+// Moves the nonzero lanes of each vector to the front with a permutation
+// from nonzero_lanes, and stores all 8 lanes. Only the nonzero ones are
+// counted, the others are overwritten by the next vector. The stores stay
+// within the arrays, since there are never more nonzero counts than counts
+// before the vector.
+__attribute__((target("avx2")))
+size_t FindNonZeroCountsAVX2(const uint32_t* a,
+                             const uint32_t* b,
+                             size_t size,
+                             uint16_t* symbols,
+                             uint32_t* counts) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i ramp = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  size_t num_nonzero = 0;
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&a[i]));
+    if (b != NULL) {
+      v = _mm256_add_epi32(
+          v, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&b[i])));
+    }
+    const uint32_t mask = static_cast<uint32_t>(_mm256_movemask_ps(
+        _mm256_castsi256_ps(_mm256_cmpeq_epi32(v, zero)))) ^ 0xffu;
+    const __m256i lanes = _mm256_cvtepu8_epi32(_mm_loadl_epi64(
+        reinterpret_cast<const __m128i*>(nonzero_lanes[mask])));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(&counts[num_nonzero]),
+                        _mm256_permutevar8x32_epi32(v, lanes));
+    const __m256i indices = _mm256_add_epi32(
+        _mm256_permutevar8x32_epi32(ramp, lanes),
+        _mm256_set1_epi32(static_cast<int>(i)));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(&symbols[num_nonzero]),
+                     _mm_packus_epi32(_mm256_castsi256_si128(indices),
+                                      _mm256_extracti128_si256(indices, 1)));
+    num_nonzero += static_cast<size_t>(__builtin_popcount(mask));
+  }
+  return AppendNonZeroCounts(a, b, i, size, num_nonzero, symbols, counts);
+}
+
+size_t FindNonZeroCountsSSE2(const uint32_t* a,
+                             const uint32_t* b,
+                             size_t size,
+                             uint16_t* symbols,
+                             uint32_t* counts) {
+  const __m128i zero = _mm_setzero_si128();
+  uint32_t lanes[4];
+  size_t num_nonzero = 0;
+  size_t i = 0;
+  for (; i + 4 <= size; i += 4) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&a[i]));
+    if (b != NULL) {
+      v = _mm_add_epi32(
+          v, _mm_loadu_si128(reinterpret_cast<const __m128i*>(&b[i])));
+    }
+    uint32_t mask = static_cast<uint32_t>(_mm_movemask_ps(
+        _mm_castsi128_ps(_mm_cmpeq_epi32(v, zero)))) ^ 0xfu;
+    if (mask == 0) {
+      continue;
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), v);
+    while (mask != 0) {
+      const uint32_t lane = static_cast<uint32_t>(__builtin_ctz(mask));
+      mask &= mask - 1;
+      symbols[num_nonzero] = static_cast<uint16_t>(i + lane);
+      counts[num_nonzero] = lanes[lane];
+      ++num_nonzero;
+    }
+  }
+  return AppendNonZeroCounts(a, b, i, size, num_nonzero, symbols, counts);
+}
+
+// SSE2 is part of x86-64, so only AVX2 has to be checked with CPUID.
+FindNonZeroCountsFunc ChooseFindNonZeroCounts(void) {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    InitNonZeroLanes();
+    return FindNonZeroCountsAVX2;
+  }
+  return FindNonZeroCountsSSE2;
+}
+
+#endif  // BROTLI_BIT_COST_SIMD
+
+}  // namespace
+
+size_t FindNonZeroCounts(const uint32_t* a,
+                         const uint32_t* b,
+                         size_t size,
+                         uint16_t* symbols,
+                         uint32_t* counts) {
+#ifdef BROTLI_BIT_COST_SIMD
+  static const FindNonZeroCountsFunc find_nonzero_counts =
+      ChooseFindNonZeroCounts();
+  return find_nonzero_counts(a, b, size, symbols, counts);
+#else
+  return AppendNonZeroCounts(a, b, 0, size, 0, symbols, counts);
+#endif
+}
+
+}  // namespace brotli
@@ -19,6 +19,7 @@
 #include "./command.h"
 #include "./fast_log.h"
 #include "./histogram.h"
+#include "./thread_pool.h"
 
 namespace brotli {
 
@@ -35,6 +36,7 @@ static const size_t kSymbolsPerDistanceHistogram = 544;
 static const size_t kMinLengthForBlockSplitting = 128;
 static const size_t kIterMulForRefining = 2;
 static const size_t kMinItersForRefining = 100;
+static const size_t kHistogramsPerBatch = 64;
 
 void CopyLiteralsToByteArray(const Command* cmds,
                              const size_t num_commands,
@@ -120,21 +122,89 @@ void RandomSample(unsigned int* seed,
   sample->Add(data + pos, stride);
 }
 
+// Adds the samples that belong to histograms[begin..end) to them, the sample
+// positions are drawn in advance so that the result is the same as that of
+// the sequential loop.
+template<typename HistogramType, typename DataType>
+class RefineEntropyCodesTask : public ThreadPoolTask {
+ public:
+  RefineEntropyCodesTask(const DataType* data,
+                         size_t stride,
+                         const std::vector<size_t>* positions,
+                         size_t num_histograms,
+                         size_t begin,
+                         size_t end,
+                         HistogramType* histograms)
+      : data_(data),
+        stride_(stride),
+        positions_(positions),
+        num_histograms_(num_histograms),
+        begin_(begin),
+        end_(end),
+        histograms_(histograms) {}
+
+  void Run(void) {
+    for (size_t ix = begin_; ix < end_; ++ix) {
+      for (size_t iter = ix; iter < positions_->size();
+           iter += num_histograms_) {
+        histograms_[ix].Add(data_ + (*positions_)[iter], stride_);
+      }
+    }
+  }
+
+ private:
+  const DataType* data_;
+  size_t stride_;
+  const std::vector<size_t>* positions_;
+  size_t num_histograms_;
+  size_t begin_;
+  size_t end_;
+  HistogramType* histograms_;
+};
+
+// If pool is not NULL, the histograms are partitioned between its threads.
 template<typename HistogramType, typename DataType>
 void RefineEntropyCodes(const DataType* data, size_t length,
                         size_t stride,
                         size_t num_histograms,
+                        ThreadPool* pool,
                         HistogramType* histograms) {
   size_t iters =
       kIterMulForRefining * length / stride + kMinItersForRefining;
   unsigned int seed = 7;
   iters = ((iters + num_histograms - 1) / num_histograms) * num_histograms;
-  for (size_t iter = 0; iter < iters; ++iter) {
-    HistogramType sample;
-    RandomSample(&seed, data, length, stride, &sample);
-    size_t ix = iter % num_histograms;
-    histograms[ix].AddHistogram(sample);
+  if (pool == NULL || pool->num_threads() <= 1) {
+    for (size_t iter = 0; iter < iters; ++iter) {
+      HistogramType sample;
+      RandomSample(&seed, data, length, stride, &sample);
+      size_t ix = iter % num_histograms;
+      histograms[ix].AddHistogram(sample);
+    }
+    return;
+  }
+  // Same sequence of samples as in RandomSample.
+  std::vector<size_t> positions(iters);
+  if (stride >= length) {
+    stride = length;
+  } else {
+    for (size_t iter = 0; iter < iters; ++iter) {
+      positions[iter] = MyRand(&seed) % (length - stride + 1);
+    }
+  }
+  const size_t num_tasks =
+      std::min(num_histograms, static_cast<size_t>(pool->num_threads()));
+  std::vector<RefineEntropyCodesTask<HistogramType, DataType> > tasks;
+  tasks.reserve(num_tasks);
+  for (size_t i = 0; i < num_tasks; ++i) {
+    tasks.push_back(RefineEntropyCodesTask<HistogramType, DataType>(
+        data, stride, &positions, num_histograms,
+        num_histograms * i / num_tasks, num_histograms * (i + 1) / num_tasks,
+        histograms));
+  }
+  for (size_t i = 0; i < num_tasks; ++i) {
+    pool->Schedule(&tasks[i]);
   }
+  pool->Wait();
 }
 
 inline static double BitCost(size_t count) {
@@ -263,13 +333,81 @@ void BuildBlockHistograms(const DataType* data, const size_t length,
   }
 }
 
+// Builds the histograms of up to kHistogramsPerBatch consecutive blocks and
+// does the first clustering pass of ClusterBlocks on them. A task can be
+// reused for the next batch after its clusters have been appended.
+template<typename HistogramType, typename DataType>
+class BlockBatchTask : public ThreadPoolTask {
+ public:
+  explicit BlockBatchTask(size_t max_num_blocks)
+      : histograms_(max_num_blocks),
+        pairs_(kHistogramsPerBatch * kHistogramsPerBatch / 2 + 1),
+        data_(NULL),
+        block_lengths_(NULL),
+        num_blocks_(0),
+        num_clusters_(0) {}
+
+  void Init(const DataType* data, const uint32_t* block_lengths,
+            size_t num_blocks) {
+    data_ = data;
+    block_lengths_ = block_lengths;
+    num_blocks_ = num_blocks;
+  }
+
+  void Run(void) {
+    size_t pos = 0;
+    for (size_t j = 0; j < num_blocks_; ++j) {
+      histograms_[j].Clear();
+      for (size_t k = 0; k < block_lengths_[j]; ++k) {
+        histograms_[j].Add(data_[pos++]);
+      }
+      histograms_[j].bit_cost_ = PopulationCost(histograms_[j]);
+      symbols_[j] = clusters_[j] = static_cast<uint32_t>(j);
+      sizes_[j] = 1;
+    }
+    num_clusters_ = HistogramCombine(
+        &histograms_[0], sizes_, symbols_, clusters_, &pairs_[0], num_blocks_,
+        num_blocks_, kHistogramsPerBatch, pairs_.size() - 1);
+  }
+
+  // Appends the clusters of the batch to *histograms and *cluster_size, and
+  // sets the cluster index of each block of the batch in symbols[].
+  void AppendClusters(std::vector<HistogramType>* histograms,
+                      std::vector<uint32_t>* cluster_size,
+                      uint32_t* symbols) {
+    const uint32_t offset = static_cast<uint32_t>(histograms->size());
+    uint32_t remap[kHistogramsPerBatch];
+    for (size_t j = 0; j < num_clusters_; ++j) {
+      histograms->push_back(histograms_[clusters_[j]]);
+      cluster_size->push_back(sizes_[clusters_[j]]);
+      remap[clusters_[j]] = static_cast<uint32_t>(j);
+    }
+    for (size_t j = 0; j < num_blocks_; ++j) {
+      symbols[j] = offset + remap[symbols_[j]];
+    }
+  }
+
+ private:
+  std::vector<HistogramType> histograms_;
+  std::vector<HistogramPair> pairs_;
+  const DataType* data_;
+  const uint32_t* block_lengths_;
+  size_t num_blocks_;
+  size_t num_clusters_;
+  uint32_t sizes_[kHistogramsPerBatch];
+  uint32_t clusters_[kHistogramsPerBatch];
+  uint32_t symbols_[kHistogramsPerBatch];
+};
+
+// If pool is not NULL, the batches of the first clustering pass are processed
+// on its threads, and their clusters are appended in batch order.
 template<typename HistogramType, typename DataType>
 void ClusterBlocks(const DataType* data, const size_t length,
                    const size_t num_blocks,
                    uint8_t* block_ids,
+                   ThreadPool* pool,
                    BlockSplit* split) {
   static const size_t kMaxNumberOfBlockTypes = 256;
-  static const size_t kHistogramsPerBatch = 64;
   static const size_t kClustersPerBatch = 16;
   std::vector<uint32_t> histogram_symbols(num_blocks);
   std::vector<uint32_t> block_lengths(num_blocks);
@@ -291,47 +429,46 @@ void ClusterBlocks(const DataType* data, const size_t length,
   std::vector<uint32_t> cluster_size;
   all_histograms.reserve(expected_num_clusters);
   cluster_size.reserve(expected_num_clusters);
-  size_t num_clusters = 0;
-  std::vector<HistogramType> histograms(
-      std::min(num_blocks, kHistogramsPerBatch));
-  size_t max_num_pairs = kHistogramsPerBatch * kHistogramsPerBatch / 2;
-  std::vector<HistogramPair> pairs(max_num_pairs + 1);
+  const size_t num_batches =
+      (num_blocks + kHistogramsPerBatch - 1) / kHistogramsPerBatch;
+  const size_t num_tasks = pool == NULL ? 1 :
+      std::min(num_batches, static_cast<size_t>(pool->num_threads()));
+  std::vector<BlockBatchTask<HistogramType, DataType> > tasks(
+      num_tasks, BlockBatchTask<HistogramType, DataType>(
+          std::min(num_blocks, kHistogramsPerBatch)));
   size_t pos = 0;
-  for (size_t i = 0; i < num_blocks; i += kHistogramsPerBatch) {
-    const size_t num_to_combine = std::min(num_blocks - i, kHistogramsPerBatch);
-    uint32_t sizes[kHistogramsPerBatch];
-    uint32_t clusters[kHistogramsPerBatch];
-    uint32_t symbols[kHistogramsPerBatch];
-    uint32_t remap[kHistogramsPerBatch];
-    for (size_t j = 0; j < num_to_combine; ++j) {
-      histograms[j].Clear();
-      for (size_t k = 0; k < block_lengths[i + j]; ++k) {
-        histograms[j].Add(data[pos++]);
+  for (size_t i = 0; i < num_blocks; i += num_tasks * kHistogramsPerBatch) {
+    size_t num_running = 0;
+    for (size_t start = i;
+         num_running < num_tasks && start < num_blocks;
+         start += kHistogramsPerBatch, ++num_running) {
+      const size_t num_to_combine =
+          std::min(num_blocks - start, kHistogramsPerBatch);
+      tasks[num_running].Init(&data[pos], &block_lengths[start],
+                              num_to_combine);
+      for (size_t j = 0; j < num_to_combine; ++j) {
+        pos += block_lengths[start + j];
       }
-      histograms[j].bit_cost_ = PopulationCost(histograms[j]);
-      symbols[j] = clusters[j] = static_cast<uint32_t>(j);
-      sizes[j] = 1;
     }
-    size_t num_new_clusters = HistogramCombine(
-        &histograms[0], sizes, symbols, clusters, &pairs[0], num_to_combine,
-        num_to_combine, kHistogramsPerBatch, max_num_pairs);
-    for (size_t j = 0; j < num_new_clusters; ++j) {
-      all_histograms.push_back(histograms[clusters[j]]);
-      cluster_size.push_back(sizes[clusters[j]]);
-      remap[clusters[j]] = static_cast<uint32_t>(j);
+    if (num_running > 1) {
+      for (size_t k = 0; k < num_running; ++k) {
+        pool->Schedule(&tasks[k]);
+      }
+      pool->Wait();
+    } else {
+      tasks[0].Run();
     }
-    for (size_t j = 0; j < num_to_combine; ++j) {
-      histogram_symbols[i + j] =
-          static_cast<uint32_t>(num_clusters) + remap[symbols[j]];
+    for (size_t k = 0; k < num_running; ++k) {
+      tasks[k].AppendClusters(&all_histograms, &cluster_size,
+                              &histogram_symbols[i + k * kHistogramsPerBatch]);
     }
-    num_clusters += num_new_clusters;
-    assert(num_clusters == cluster_size.size());
-    assert(num_clusters == all_histograms.size());
   }
+  const size_t num_clusters = all_histograms.size();
+  assert(num_clusters == cluster_size.size());
 
-  max_num_pairs =
+  size_t max_num_pairs =
       std::min(64 * num_clusters, (num_clusters / 2) * num_clusters);
-  pairs.resize(max_num_pairs + 1);
+  std::vector<HistogramPair> pairs(max_num_pairs + 1);
 
   std::vector<uint32_t> clusters(num_clusters);
   for (size_t i = 0; i < num_clusters; ++i) {
@@ -397,6 +534,7 @@ void SplitByteVector(const std::vector<DataType>& data,
                      const size_t max_histograms,
                      const size_t sampling_stride_length,
                      const double block_switch_cost,
+                     ThreadPool* pool,
                      BlockSplit* split) {
   if (data.empty()) {
     split->num_types = 1;
@@ -418,7 +556,7 @@ void SplitByteVector(const std::vector<DataType>& data,
                       num_histograms, histograms);
   RefineEntropyCodes(&data[0], data.size(),
                      sampling_stride_length,
-                     num_histograms, histograms);
+                     num_histograms, pool, histograms);
   // Find a good path through literals with the good entropy codes.
   std::vector<uint8_t> block_ids(data.size());
   size_t num_blocks;
@@ -444,7 +582,62 @@ void SplitByteVector(const std::vector<DataType>& data,
   delete[] new_id;
   delete[] histograms;
   ClusterBlocks<Histogram<kSize> >(&data[0], data.size(), num_blocks,
-                                   &block_ids[0], split);
+                                   &block_ids[0], pool, split);
+}
+
+// Runs SplitByteVector on a worker thread.
+template<int kSize, typename DataType>
+class SplitByteVectorTask : public ThreadPoolTask {
+ public:
+  SplitByteVectorTask(const std::vector<DataType>* data,
+                      const size_t literals_per_histogram,
+                      const size_t max_histograms,
+                      const size_t sampling_stride_length,
+                      const double block_switch_cost,
+                      BlockSplit* split)
+      : data_(data),
+        literals_per_histogram_(literals_per_histogram),
+        max_histograms_(max_histograms),
+        sampling_stride_length_(sampling_stride_length),
+        block_switch_cost_(block_switch_cost),
+        split_(split) {}
+
+  void Run(void) {
+    SplitByteVector<kSize>(*data_, literals_per_histogram_, max_histograms_,
+                           sampling_stride_length_, block_switch_cost_,
+                           NULL, split_);
+  }
+
+ private:
+  const std::vector<DataType>* data_;
+  const size_t literals_per_histogram_;
+  const size_t max_histograms_;
+  const size_t sampling_stride_length_;
+  const double block_switch_cost_;
+  BlockSplit* split_;
+};
+
+static void CopyCommandPrefixesToArray(const Command* cmds,
+                                       const size_t num_commands,
+                                       std::vector<uint16_t>* codes) {
+  codes->resize(num_commands);
+  for (size_t i = 0; i < num_commands; ++i) {
+    (*codes)[i] = cmds[i].cmd_prefix_;
+  }
+}
+
+static void CopyDistancePrefixesToArray(const Command* cmds,
+                                        const size_t num_commands,
+                                        std::vector<uint16_t>* prefixes) {
+  prefixes->resize(num_commands);
+  size_t pos = 0;
+  for (size_t i = 0; i < num_commands; ++i) {
+    const Command& cmd = cmds[i];
+    if (cmd.copy_len() && cmd.cmd_prefix_ >= 128) {
+      (*prefixes)[pos++] = cmd.dist_prefix_;
+    }
+  }
+  prefixes->resize(pos);
 }
 
 void SplitBlock(const Command* cmds,
@@ -465,41 +658,79 @@ void SplitBlock(const Command* cmds,
         literals,
         kSymbolsPerLiteralHistogram, kMaxLiteralHistograms,
         kLiteralStrideLength, kLiteralBlockSwitchCost,
-        literal_split);
+        NULL, literal_split);
   }
 
   {
     // Compute prefix codes for commands.
-    std::vector<uint16_t> insert_and_copy_codes(num_commands);
-    for (size_t i = 0; i < num_commands; ++i) {
-      insert_and_copy_codes[i] = cmds[i].cmd_prefix_;
-    }
+    std::vector<uint16_t> insert_and_copy_codes;
+    CopyCommandPrefixesToArray(cmds, num_commands, &insert_and_copy_codes);
     // Create the block split on the array of command prefixes.
     SplitByteVector<kNumCommandPrefixes>(
         insert_and_copy_codes,
         kSymbolsPerCommandHistogram, kMaxCommandHistograms,
         kCommandStrideLength, kCommandBlockSwitchCost,
-        insert_and_copy_split);
+        NULL, insert_and_copy_split);
   }
 
   {
     // Create a continuous array of distance prefixes.
-    std::vector<uint16_t> distance_prefixes(num_commands);
-    size_t pos = 0;
-    for (size_t i = 0; i < num_commands; ++i) {
-      const Command& cmd = cmds[i];
-      if (cmd.copy_len() && cmd.cmd_prefix_ >= 128) {
-        distance_prefixes[pos++] = cmd.dist_prefix_;
-      }
-    }
-    distance_prefixes.resize(pos);
+    std::vector<uint16_t> distance_prefixes;
+    CopyDistancePrefixesToArray(cmds, num_commands, &distance_prefixes);
     // Create the block split on the array of distance prefixes.
     SplitByteVector<kNumDistancePrefixes>(
         distance_prefixes,
         kSymbolsPerDistanceHistogram, kMaxCommandHistograms,
         kCommandStrideLength, kDistanceBlockSwitchCost,
-        dist_split);
+        NULL, dist_split);
   }
 }
 
+void SplitBlock(const Command* cmds,
+                const size_t num_commands,
+                const uint8_t* data,
+                const size_t pos,
+                const size_t mask,
+                int num_threads,
+                BlockSplit* literal_split,
+                BlockSplit* insert_and_copy_split,
+                BlockSplit* dist_split) {
+  if (num_threads <= 1) {
+    SplitBlock(cmds, num_commands, data, pos, mask,
+               literal_split, insert_and_copy_split, dist_split);
+    return;
+  }
+  std::vector<uint8_t> literals;
+  CopyLiteralsToByteArray(cmds, num_commands, data, pos, mask, &literals);
+  std::vector<uint16_t> insert_and_copy_codes;
+  CopyCommandPrefixesToArray(cmds, num_commands, &insert_and_copy_codes);
+  std::vector<uint16_t> distance_prefixes;
+  CopyDistancePrefixesToArray(cmds, num_commands, &distance_prefixes);
+
+  // The command and distance splits are much cheaper than the literal split,
+  // so they get one worker thread each, and the literal split runs on the
+  // calling thread with the remaining threads helping with its entropy code
+  // refinement and block clustering.
+  ThreadPool pool(2);
+  SplitByteVectorTask<kNumCommandPrefixes, uint16_t> command_task(
+      &insert_and_copy_codes,
+      kSymbolsPerCommandHistogram, kMaxCommandHistograms,
+      kCommandStrideLength, kCommandBlockSwitchCost,
+      insert_and_copy_split);
+  SplitByteVectorTask<kNumDistancePrefixes, uint16_t> distance_task(
+      &distance_prefixes,
+      kSymbolsPerDistanceHistogram, kMaxCommandHistograms,
+      kCommandStrideLength, kDistanceBlockSwitchCost,
+      dist_split);
+  pool.Schedule(&command_task);
+  pool.Schedule(&distance_task);
+  ThreadPool literal_pool(num_threads - 2);
+  SplitByteVector<256>(
+      literals,
+      kSymbolsPerLiteralHistogram, kMaxLiteralHistograms,
+      kLiteralStrideLength, kLiteralBlockSwitchCost,
+      &literal_pool, literal_split);
+  pool.Wait();
+}
+
 }  // namespace brotli
@@ -56,6 +56,20 @@ void SplitBlock(const Command* cmds,
                 BlockSplit* insert_and_copy_split,
                 BlockSplit* dist_split);
 
+// Same as above, but computes the literal, command and distance splits
+// concurrently and spreads the entropy code refinement and block clustering
+// of the literal split over the remaining threads, using about num_threads
+// threads in total. The result does not depend on num_threads.
+void SplitBlock(const Command* cmds,
+                const size_t num_commands,
+                const uint8_t* data,
+                const size_t offset,
+                const size_t mask,
+                int num_threads,
+                BlockSplit* literal_split,
+                BlockSplit* insert_and_copy_split,
+                BlockSplit* dist_split);
+
 }  // namespace brotli
 
 #endif  // BROTLI_ENC_BLOCK_SPLITTER_H_
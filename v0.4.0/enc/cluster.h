@@ -19,6 +19,7 @@
 #include "./fast_log.h"
 #include "./histogram.h"
 #include "./port.h"
+#include "./thread_pool.h"
 #include "./types.h"
 
 namespace brotli {
@@ -79,9 +80,7 @@ void CompareAndPushToQueue(const HistogramType* out,
   } else {
     double threshold = *num_pairs == 0 ? 1e99 :
         std::max(0.0, pairs[0].cost_diff);
-    HistogramType combo = out[idx1];
-    combo.AddHistogram(out[idx2]);
-    double cost_combo = PopulationCost(combo);
+    double cost_combo = PopulationCost(out[idx1], out[idx2]);
     if (cost_combo < threshold - p.cost_diff) {
       p.cost_combo = cost_combo;
       store_pair = true;
@@ -118,6 +117,13 @@ size_t HistogramCombine(HistogramType* out,
 
   // We maintain a vector of histogram pairs, with the property that the pair
   // with the maximum bit cost reduction is the first.
+  //
+  // The merge decisions also depend on the order of the other pairs: of two
+  // pairs with the same cost the first one wins, and the front is moved to
+  // the slot of each better pair in the pass after a merge. A priority queue
+  // has to keep this order to give the same output, and then it is slower
+  // than the pass, which costs less per merge than the new pairs of the
+  // merged histogram pushed after it.
   size_t num_pairs = 0;
   for (size_t idx1 = 0; idx1 < num_clusters; ++idx1) {
     for (size_t idx2 = idx1 + 1; idx2 < num_clusters; ++idx2) {
@@ -191,9 +197,7 @@ double HistogramBitCostDistance(const HistogramType& histogram,
   if (histogram.total_count_ == 0) {
     return 0.0;
   }
-  HistogramType tmp = histogram;
-  tmp.AddHistogram(candidate);
-  return PopulationCost(tmp) - candidate.bit_cost_;
+  return PopulationCost(histogram, candidate) - candidate.bit_cost_;
 }
 
 // Find the best 'out' histogram for each of the 'in' histograms.
@@ -262,13 +266,58 @@ size_t HistogramReindex(HistogramType* out, uint32_t* symbols, size_t length) {
   return next_index;
 }
 
+// Combines one batch of the first pass of ClusterHistograms. The batches use
+// disjoint parts of the arrays, so they can run concurrently.
+template<typename HistogramType>
+class HistogramCombineTask : public ThreadPoolTask {
+ public:
+  HistogramCombineTask(HistogramType* out,
+                       uint32_t* cluster_size,
+                       uint32_t* symbols,
+                       uint32_t* clusters,
+                       size_t num_clusters,
+                       size_t max_clusters,
+                       size_t max_num_pairs)
+      : out_(out),
+        cluster_size_(cluster_size),
+        symbols_(symbols),
+        clusters_(clusters),
+        num_clusters_(num_clusters),
+        max_clusters_(max_clusters),
+        max_num_pairs_(max_num_pairs),
+        num_new_clusters_(0) {}
+
+  void Run(void) {
+    std::vector<HistogramPair> pairs(max_num_pairs_ + 1);
+    num_new_clusters_ = HistogramCombine(out_, cluster_size_, symbols_,
+                                         clusters_, &pairs[0],
+                                         num_clusters_, num_clusters_,
+                                         max_clusters_, max_num_pairs_);
+  }
+
+  size_t num_new_clusters(void) const { return num_new_clusters_; }
+
+ private:
+  HistogramType* out_;
+  uint32_t* cluster_size_;
+  uint32_t* symbols_;
+  uint32_t* clusters_;
+  size_t num_clusters_;
+  size_t max_clusters_;
+  size_t max_num_pairs_;
+  size_t num_new_clusters_;
+};
+
 // Clusters similar histograms in 'in' together, the selected histograms are
 // placed in 'out', and for each index in 'in', *histogram_symbols will
 // indicate which of the 'out' histograms is the best approximation.
+// If pool is not NULL, the independent batches of the first clustering pass
+// are combined on its threads. The result does not depend on the pool.
 template<typename HistogramType>
 void ClusterHistograms(const std::vector<HistogramType>& in,
                        size_t num_contexts, size_t num_blocks,
                        size_t max_histograms,
+                       ThreadPool* pool,
                        std::vector<HistogramType>* out,
                        std::vector<uint32_t>* histogram_symbols) {
   const size_t in_size = num_contexts * num_blocks;
@@ -289,18 +338,45 @@ void ClusterHistograms(const std::vector<HistogramType>& in,
   size_t max_num_pairs = max_input_histograms * max_input_histograms / 2;
   std::vector<HistogramPair> pairs(max_num_pairs + 1);
 
-  for (size_t i = 0; i < in_size; i += max_input_histograms) {
-    size_t num_to_combine = std::min(in_size - i, max_input_histograms);
-    for (size_t j = 0; j < num_to_combine; ++j) {
-      clusters[num_clusters + j] = static_cast<uint32_t>(i + j);
+  if (pool != NULL && pool->num_threads() > 1 &&
+      in_size > max_input_histograms) {
+    // Every batch keeps its clusters in its own range of clusters[], they
+    // are moved together in batch order after all batches are done.
+    std::vector<HistogramCombineTask<HistogramType> > tasks;
+    tasks.reserve((in_size + max_input_histograms - 1) / max_input_histograms);
+    for (size_t i = 0; i < in_size; i += max_input_histograms) {
+      size_t num_to_combine = std::min(in_size - i, max_input_histograms);
+      for (size_t j = 0; j < num_to_combine; ++j) {
+        clusters[i + j] = static_cast<uint32_t>(i + j);
+      }
+      tasks.push_back(HistogramCombineTask<HistogramType>(
+          &(*out)[0], &cluster_size[0], &(*histogram_symbols)[i],
+          &clusters[i], num_to_combine, max_histograms, max_num_pairs));
+    }
+    for (size_t k = 0; k < tasks.size(); ++k) {
+      pool->Schedule(&tasks[k]);
+    }
+    pool->Wait();
+    for (size_t k = 0; k < tasks.size(); ++k) {
+      const size_t num_new_clusters = tasks[k].num_new_clusters();
+      memmove(&clusters[num_clusters], &clusters[k * max_input_histograms],
+              num_new_clusters * sizeof(clusters[0]));
+      num_clusters += num_new_clusters;
+    }
+  } else {
+    for (size_t i = 0; i < in_size; i += max_input_histograms) {
+      size_t num_to_combine = std::min(in_size - i, max_input_histograms);
+      for (size_t j = 0; j < num_to_combine; ++j) {
+        clusters[num_clusters + j] = static_cast<uint32_t>(i + j);
+      }
+      size_t num_new_clusters =
+          HistogramCombine(&(*out)[0], &cluster_size[0],
+                           &(*histogram_symbols)[i],
+                           &clusters[num_clusters], &pairs[0],
+                           num_to_combine, num_to_combine,
+                           max_histograms, max_num_pairs);
+      num_clusters += num_new_clusters;
     }
-    size_t num_new_clusters =
-        HistogramCombine(&(*out)[0], &cluster_size[0],
-                         &(*histogram_symbols)[i],
-                         &clusters[num_clusters], &pairs[0],
-                         num_to_combine, num_to_combine,
-                         max_histograms, max_num_pairs);
-    num_clusters += num_new_clusters;
   }
 
   // For the second pass, we limit the total number of histogram pairs.
@@ -325,6 +401,16 @@ void ClusterHistograms(const std::vector<HistogramType>& in,
   out->resize(num_histograms);
 }
 
+template<typename HistogramType>
+void ClusterHistograms(const std::vector<HistogramType>& in,
+                       size_t num_contexts, size_t num_blocks,
+                       size_t max_histograms,
+                       std::vector<HistogramType>* out,
+                       std::vector<uint32_t>* histogram_symbols) {
+  ClusterHistograms(in, num_contexts, num_blocks, max_histograms, NULL,
+                    out, histogram_symbols);
+}
+
 }  // namespace brotli
 
 #endif  // BROTLI_ENC_CLUSTER_H_
@@ -4112,6 +4112,183 @@ static const uint16_t kStaticDictionaryHash[] = {
   0x0000, 0x0000, 0x0d88, 0x4ac5, 0x0000, 0x0000, 0x0000, 0x0000,
 };
 
+// Bit (i & 31) of kStaticDictionaryHashFilter[i >> 5] is set if
+// kStaticDictionaryHash[i] is not zero. At 4 KB, the filter stays in the
+// cache, so most lookups of empty entries do not touch the 64 KB hash table.
+static const uint32_t kStaticDictionaryHashFilter[] = {
+  0x40820201, 0x023000b8, 0x28108026, 0x00040008, 0x08900000, 0x00000800,
+  0x2ec02000, 0x00020000, 0x39120533, 0x10188080, 0x0f120000, 0x4400cb0a,
+  0xa00200ac, 0x023103b0, 0x0028a618, 0x0e0020a0, 0x208e8f01, 0x03208342,
+  0x3006000c, 0x00005601, 0xc80000f2, 0x3003b002, 0x80210040, 0x0448800c,
+  0x05019c38, 0x90000380, 0x07cc0080, 0x1a1e40a8, 0x03000310, 0x00888208,
+  0x10001800, 0x00880283, 0x0801800c, 0x008038c2, 0xa824340c, 0x00250000,
+  0x0a000224, 0x022800f0, 0x83c80008, 0xa0003002, 0x000220c0, 0xc01e0308,
+  0x101a10b2, 0x00000000, 0x048c0823, 0x030a8000, 0x0c889807, 0x07040312,
+  0x00c20080, 0x80013008, 0xe2042000, 0x08033800, 0x1030c000, 0x20028100,
+  0x0f0b4302, 0x13001100, 0x20300000, 0x01a20080, 0x10000000, 0x0000022c,
+  0x00000090, 0x10024ac0, 0x8054083a, 0x0502c021, 0xc04c0220, 0x80809800,
+  0x01420300, 0x83002000, 0x00003008, 0x3030a000, 0xa1000108, 0x48ca0080,
+  0x07000203, 0x20210000, 0x4030c001, 0xf913b4b1, 0x280a6030, 0x000b0014,
+  0x00800040, 0x240c0020, 0xa000c303, 0x208e8cd0, 0x30c20000, 0x301c2370,
+  0x2b08820c, 0x08100048, 0xb1d08000, 0xc0000022, 0x0020b200, 0x00018018,
+  0x2c200200, 0x2a00e100, 0x0c200ec6, 0xa0010000, 0x1cc00200, 0x00c00014,
+  0x30c03207, 0xc0020000, 0x06097002, 0x60000100, 0x0023e800, 0x0030c03e,
+  0xcc808001, 0x30312038, 0xc820184a, 0x00020200, 0x00800020, 0x401098a0,
+  0x020c0200, 0x20300008, 0xa0008002, 0x27308028, 0x2c220c06, 0x5ac00810,
+  0x13003080, 0x00002a29, 0x020804c0, 0xc0d31010, 0xc8000800, 0x40020048,
+  0x240b9000, 0xf00e0000, 0x030f0280, 0x0003050e, 0x8800e3c0, 0x002008e0,
+  0x801000b0, 0x00208000, 0x00e10fa4, 0xe0800200, 0x20228b2c, 0x280c3060,
+  0x00400000, 0x0c020043, 0x0090cc88, 0x08200422, 0xa000482c, 0xc202e008,
+  0x02020070, 0x0c1a8000, 0xcc02010c, 0x0a80a0c0, 0x03c20700, 0x0200420c,
+  0x0408b000, 0x000200a0, 0xc3e1ac00, 0x002b2000, 0x0b04e200, 0x0802040f,
+  0x1c080b80, 0x3e840008, 0x00022060, 0x80008008, 0x89900a32, 0x40000000,
+  0x000c000c, 0x01130200, 0x00300b22, 0x000250c0, 0x30000008, 0x80210040,
+  0x16000000, 0x08002801, 0x0b108011, 0x202a0800, 0x20020800, 0x80800520,
+  0x21041002, 0x0b004000, 0x0c028200, 0x00000203, 0xc80c0020, 0x10040000,
+  0x10210229, 0x80200305, 0x809c4000, 0xc0002c00, 0x84000880, 0x480c0000,
+  0xc0400834, 0x04000000, 0xc090000c, 0x02c04000, 0x01020482, 0x200400c3,
+  0x183ce820, 0x20000102, 0x00c0000e, 0x000a00c3, 0x0200080c, 0x3044202c,
+  0xb2001c80, 0x3c03001c, 0xc00f1020, 0x0018c000, 0x0118e000, 0x800c8e0c,
+  0x3cf00400, 0x1200f000, 0x20092032, 0x07008370, 0x08010020, 0xa3281e12,
+  0xa0000080, 0x4a020002, 0x2830200b, 0x00c0c200, 0x200900cc, 0xc10216e0,
+  0x0a3c0400, 0x0000c000, 0x02807131, 0x000804d0, 0x000b8008, 0x0122500c,
+  0x0282dac8, 0x08980800, 0x00002320, 0x802000c0, 0x0300200c, 0x00082002,
+  0x0100826a, 0x00300000, 0x20002001, 0x30020d02, 0x00100b00, 0x00eca080,
+  0x42002040, 0x0c002002, 0x90bc0221, 0x0000b001, 0x20400020, 0x0c030820,
+  0x000ec000, 0x00002000, 0x08010100, 0x02280cc0, 0x03002300, 0x400820c8,
+  0x0024c000, 0x00113001, 0x18023e30, 0x0020c088, 0x0a00044b, 0x82c00812,
+  0x2e234200, 0x78002088, 0x0000a824, 0x0a022308, 0x10100821, 0x020c0000,
+  0xd3200210, 0x0202c000, 0x10300033, 0x3b0000f0, 0x08880b01, 0x23000044,
+  0x86000310, 0x0000c000, 0x0000c380, 0xc034b001, 0xc00cc000, 0x0009000a,
+  0x2400ec00, 0x00c00120, 0x000b0040, 0xc00c028b, 0x43c20000, 0x00003028,
+  0x0021e022, 0x80002068, 0x00000900, 0x2f020201, 0x2fe00000, 0x10080060,
+  0x00010800, 0xc8100080, 0x00100208, 0x80010892, 0xa3000000, 0x38004000,
+  0x00000186, 0x0b301020, 0xc00b020b, 0x0b248821, 0x01202c00, 0x00302803,
+  0x36040000, 0xc2201080, 0xa0490600, 0x00c02008, 0x82008000, 0x81020040,
+  0x18400000, 0xd800c030, 0x100000ad, 0x04028004, 0x0000086c, 0x200c0001,
+  0xb4880080, 0x210300a8, 0x28002c04, 0xb000f200, 0x040c8c38, 0x20c020a0,
+  0x00500304, 0x0900c001, 0x030182d1, 0x8060c020, 0x00000003, 0x6000210f,
+  0x000030ac, 0x02380828, 0x0008180c, 0x00040808, 0x020b3b02, 0x00000032,
+  0x813101b9, 0x000d2404, 0x3808d6c0, 0x0000000c, 0x0c108209, 0xe62030c0,
+  0x0c300020, 0x40102018, 0x000a80b0, 0x80000020, 0x08402821, 0x0f300040,
+  0x81000f81, 0x00002020, 0x02090331, 0x70098000, 0x038232a0, 0x00002207,
+  0x33002011, 0x08000000, 0x481c2000, 0x32080800, 0x03021308, 0x800a1000,
+  0x2420a200, 0x3b034080, 0x00802108, 0x1000c0e0, 0x1004c080, 0x80201c00,
+  0x80882080, 0x80088000, 0xc0000084, 0xa300308c, 0x0a080010, 0x00802333,
+  0x0280c000, 0x04308880, 0x00200820, 0x340c8100, 0x0830e0c2, 0x30002022,
+  0x01003c45, 0x82c0b0b0, 0x0d009d00, 0x00a00002, 0x3800d800, 0x1081c041,
+  0xc8024002, 0x00801e00, 0x00800008, 0x0300840e, 0x0c800211, 0xf02c0018,
+  0x402002c0, 0x074a0200, 0x84008000, 0x04013c08, 0x0008280b, 0x33bb2802,
+  0x90014002, 0x4420220a, 0x20030004, 0xc08400c4, 0x002033c0, 0x00e0aa34,
+  0x03380000, 0x0c38400a, 0xc3103c22, 0x32080000, 0x00081002, 0x8c003c00,
+  0x0b0800a8, 0xc0001602, 0x20020040, 0x01000440, 0x0182cb00, 0x00b00319,
+  0xc090c000, 0x00800004, 0xc0000000, 0xc0443080, 0x08800020, 0x02000000,
+  0x007c0020, 0x30000800, 0x00034100, 0xf9400080, 0x00211308, 0xc000c0c6,
+  0x0000022c, 0xf2402000, 0x37000200, 0x00a40060, 0x00700008, 0xb1020000,
+  0xc0200000, 0x00202202, 0x40300800, 0x028880c0, 0x60042a20, 0x302022a0,
+  0x0000e072, 0x0882401c, 0x0002080c, 0x03620c3b, 0x8022c80c, 0x27000040,
+  0x8382852d, 0xc1008220, 0xa5002004, 0x00040083, 0x02cf2f80, 0x020c4040,
+  0x80030003, 0x002300c0, 0xc028020a, 0x20008080, 0x80024008, 0x08c803c0,
+  0x00802260, 0x28204932, 0x00006100, 0x00384e4a, 0x00002828, 0x000e8a04,
+  0x802000c0, 0x08800008, 0x00808000, 0xc0002023, 0x00341210, 0x32002000,
+  0x2b50c00a, 0x80080008, 0x90040022, 0x2c011070, 0x0428a000, 0x83010003,
+  0x0e000000, 0x03300080, 0x21ca0204, 0x70200088, 0x200a0020, 0x40008080,
+  0x82c9a320, 0x3020000b, 0x010c3000, 0xc000b800, 0x6d620200, 0x5002f002,
+  0x2302292f, 0x02020040, 0x00021080, 0x060c1400, 0x48100008, 0x00003003,
+  0xa0800018, 0x08383000, 0x050c0a00, 0x10380258, 0x02041c04, 0x2d02c083,
+  0x02c30004, 0x0324001c, 0x00a1a030, 0x04800c8e, 0x20007020, 0x20000074,
+  0x0e002082, 0x80300028, 0x0b401020, 0x00001800, 0x0000c022, 0x20002000,
+  0x0020c800, 0x02030020, 0x22800202, 0x70000000, 0x28000808, 0x38090000,
+  0x00100000, 0xf034808a, 0x8b02c082, 0x4c208820, 0x3007c038, 0xb108ce00,
+  0x00080020, 0x00028042, 0x08e08220, 0x300800be, 0x0004300e, 0x20008200,
+  0x9f6b8022, 0x02933800, 0x00010020, 0x80004480, 0x34208004, 0x1c0b0800,
+  0x13403001, 0x22000008, 0x80000f08, 0x888020a8, 0x70000000, 0x80088e00,
+  0x00280083, 0x04a02020, 0x00108830, 0x808009a1, 0x82342c80, 0x00000001,
+  0x0100000d, 0x20c2c00d, 0x53c82000, 0x800901a0, 0x0c8300c0, 0x01028402,
+  0x12400300, 0x080c0168, 0x80820203, 0x00100061, 0x91334a28, 0x88002008,
+  0x10c0f040, 0x2084800c, 0x226a430c, 0x00009030, 0x080400b0, 0x03420030,
+  0x14190108, 0x00302084, 0x00032100, 0x28c02000, 0x80000000, 0x34cc2032,
+  0x0e0e031e, 0x0030a002, 0xa02a020a, 0x10b02106, 0x02000020, 0x00004000,
+  0x81060000, 0x24070808, 0x33330c80, 0xb0014084, 0x38039208, 0x182238c2,
+  0x00000001, 0x0302020e, 0x00801888, 0x48c0138c, 0x33400200, 0x020bc008,
+  0x2000c8c3, 0x0008a800, 0x02030000, 0x88800003, 0x003c0110, 0x23040000,
+  0x0000c100, 0x0083020c, 0x00200284, 0x3a008002, 0x80c32008, 0x82208060,
+  0x0081d401, 0x003002e4, 0x3401ec21, 0x20000040, 0x82c11000, 0x0011000f,
+  0x00004080, 0x2248000a, 0x04c00030, 0x2e08c200, 0x0a200820, 0x00120003,
+  0x88041400, 0x13208c60, 0x58334203, 0x02400130, 0x880a0100, 0x01420000,
+  0x1200c005, 0x00c18104, 0x000400c0, 0x4a10200e, 0x10000023, 0x60022901,
+  0xc8000080, 0x20080006, 0x02203800, 0x448c3002, 0x2cb02200, 0x08040c20,
+  0x00800000, 0x00000b40, 0x8001c894, 0x08200b9d, 0x00288300, 0x0080a210,
+  0x30218800, 0x50080000, 0x41084100, 0x04208300, 0x00d80011, 0xc0848080,
+  0x80ac9042, 0x20000020, 0x00000c00, 0xbe00a008, 0x2c00801c, 0x00002000,
+  0x1c00c300, 0x0034c000, 0x00002200, 0x30008082, 0x30018902, 0x00207c22,
+  0x00c07200, 0x030ca20c, 0x08c10300, 0x1c0000c6, 0x00000800, 0x08400200,
+  0x00820004, 0x00000100, 0x0000c728, 0x01c20030, 0xe8300c02, 0x02002022,
+  0x3c1000c8, 0x00c00402, 0x022000c8, 0x00002218, 0x00008bb0, 0x3203a008,
+  0xe2080a80, 0x421000c0, 0x003c2482, 0xb2c04e00, 0x04200130, 0x82230cc2,
+  0x01848001, 0x20000000, 0x4000c008, 0x0022cc18, 0x378002c2, 0x0c000040,
+  0x30f00088, 0x2803002c, 0x081400d8, 0x000c0010, 0xc4900030, 0x0c200000,
+  0x00618220, 0x32000000, 0xc02cc200, 0x32008800, 0x4c20003c, 0xcac8800e,
+  0x83100200, 0x20842080, 0x323200a8, 0x08040000, 0x3020c004, 0x03802048,
+  0x0088c084, 0x00080c30, 0x07301243, 0x31032008, 0x20002cc0, 0x12808004,
+  0x08830000, 0x084a2090, 0x00221038, 0x20102000, 0xe0220102, 0xc133c000,
+  0x2080400f, 0x63800801, 0x82020e00, 0x30022000, 0x00c0b330, 0xc032e000,
+  0x01200088, 0x00004820, 0x00063200, 0x06040000, 0x04000000, 0x8e330020,
+  0x00137303, 0x0000800a, 0x82300228, 0x0008c000, 0xa0b0c080, 0x000040c3,
+  0x01f08000, 0x00000000, 0x08600000, 0x90020200, 0x8a6c120c, 0xc002b000,
+  0xa3ee20c0, 0x00f00020, 0x02000908, 0x0c080200, 0x0e031000, 0x00008080,
+  0x000008a0, 0x40883028, 0x0d000880, 0x03800000, 0x48f82004, 0x14000440,
+  0xf0002200, 0xe0240028, 0x0c4c0200, 0xe3810c80, 0x00002000, 0x2082810c,
+  0x00060000, 0x000c0c32, 0x0000c100, 0x00000087, 0x0020c132, 0x00a0c000,
+  0x03080201, 0x00008020, 0xe3003004, 0x8100cf03, 0x20200028, 0x3003c000,
+  0x80100a0c, 0x22000cce, 0x00017800, 0x80b10302, 0x14a04800, 0x84200d10,
+  0x02021401, 0x00800b8e, 0x08180020, 0x20833403, 0xc439c00c, 0x00010c28,
+  0x22200050, 0x2100c400, 0x30080c00, 0xcc300070, 0x0390cb00, 0x00412081,
+  0x12f02000, 0xe0c80020, 0x21200310, 0xc0008000, 0x000d040d, 0x00c28006,
+  0x830302d0, 0x00088318, 0x8cc80030, 0x00888000, 0x83111200, 0x0c148208,
+  0x02082100, 0x80400032, 0xa8000010, 0xdf400000, 0x04020237, 0x0002800c,
+  0x080c9880, 0x00840130, 0x34480002, 0x81c8cf28, 0x6030010d, 0x23e0b006,
+  0x23410000, 0x00000200, 0xc070e000, 0x20009030, 0x8123c0f0, 0x00b30800,
+  0xc830e012, 0x20010012, 0x00810000, 0x0c040000, 0x90000ca0, 0x08000008,
+  0x1300e000, 0x0000002a, 0x24006200, 0x88000008, 0xc0828080, 0x28c20d08,
+  0x58204180, 0x20202200, 0x18202804, 0x82120850, 0x20000004, 0x10c20c02,
+  0x40400000, 0xe00000a0, 0x80338000, 0x03c01c20, 0x20c9000c, 0xc0d1c008,
+  0x00023308, 0x0002a020, 0x4904b120, 0x08008c03, 0x001c2000, 0xa0020000,
+  0x63408046, 0x0233c300, 0x01000200, 0xd8002b00, 0x0c003028, 0x20083200,
+  0x322008c0, 0x202b08a0, 0x00c00200, 0x00c0c000, 0x22780000, 0x00083108,
+  0x28800000, 0xc8bc01e3, 0x00bcf800, 0x0c5020c2, 0x80108080, 0x2120800c,
+  0x80008c30, 0x20e02000, 0x80c2180c, 0x220c0c00, 0x04a83000, 0x00070840,
+  0x00003002, 0xf3038048, 0x0b00c060, 0x0204000b, 0x000000f1, 0x2c03c027,
+  0x84400108, 0x33003000, 0x0a6000f4, 0xc060c000, 0x000c0650, 0x01008020,
+  0x00080009, 0xa2210002, 0x82323320, 0x0cb02002, 0x20000330, 0xd28cc204,
+  0x4b000ca2, 0x22002000, 0x03100080, 0x0210400b, 0x00280a38, 0x0a3a000e,
+  0x07010820, 0x0d000000, 0x2302c072, 0x38800400, 0x080000c0, 0x000c0c00,
+  0xc0000800, 0x00200300, 0x80880200, 0x02c01400, 0x40308082, 0x82080000,
+  0x21102310, 0x040c0002, 0x40c50000, 0x20103002, 0x2002082c, 0x380ea0c0,
+  0xa1000000, 0x00002700, 0x0850000c, 0x028c0200, 0x00000cc0, 0x38844000,
+  0x20200014, 0x6103100a, 0x0111e200, 0x0a293010, 0x4f00c068, 0x4002002c,
+  0xcc003302, 0xf3904030, 0x01022020, 0x84000280, 0x00800830, 0x080e1000,
+  0x20000200, 0x21342000, 0x88008222, 0x0c42a020, 0x6c040041, 0x10802021,
+  0x22240010, 0x00813302, 0x04840008, 0x0f002080, 0x3b302c80, 0x00000122,
+  0x8002b084, 0x01000040, 0x02200030, 0x00c339c8, 0x00084009, 0x00200c00,
+  0x05204403, 0x0000003c, 0x209e0000, 0x00020088, 0x02e00010, 0x00042224,
+  0x0c480800, 0x038b8800, 0x2012c004, 0xc0022008, 0x00000002, 0x008cd000,
+  0x20000220, 0xf0401d22, 0x0c100000, 0x02800034, 0x0303c008, 0xb0cc0001,
+  0x00220000, 0x05000c38, 0x00800020, 0x10212000, 0x0c00c008, 0x02208804,
+  0xf8220300, 0x33c00000, 0x2201e050, 0x00080102, 0x00021482, 0x00380010,
+  0x00000400, 0x03c200a2, 0x08008200, 0x03080200, 0x20133809, 0x00a00000,
+  0x02800200, 0x01000002, 0x020a0300, 0x0213a089, 0x000823c8, 0x0c8000a0,
+  0x02020288, 0x0ec00001, 0x00003000, 0x034002c8, 0x03002028, 0x03e08030,
+  0x8808f60c, 0x400e0003, 0xa022d0a0, 0x20100066, 0xe2e20308, 0x00080000,
+  0x0e010430, 0x00080820, 0x13200010, 0xbc081880, 0xb05bb0c0, 0x088400c0,
+  0x0003e008, 0x08683304, 0x0208c008, 0x0221000c, 0x03207988, 0x200c0083,
+  0x0d00b008, 0x2023080a, 0xf2468000, 0x00003400, 0x2b200000, 0x812b0109,
+  0x0c200302, 0x12802000, 0x08002030, 0x10028c33, 0x02200800, 0x00030390,
+  0xb0000008, 0x0100c001, 0x20000002, 0x01280400, 0x100dc004, 0x830402a1,
+  0x02000034, 0x9c000001, 0x00f200e0, 0x0000b080, 0x001b0008, 0x6300020a,
+  0x2080d40d, 0x00800100, 0x06008403, 0x0cac0ccc,
+};
+
 }  // namespace brotli
 
 #endif  // BROTLI_ENC_DICTIONARY_HASH_H_
@@ -9,9 +9,12 @@
 #include "./encode.h"
 
 #include <algorithm>
+#include <chrono>
 #include <cstdlib>  /* free, malloc */
 #include <cstring>  /* memset */
+#include <deque>
 #include <limits>
+#include <thread>
 //#include <iostream> /* used for debugging */
 
 
@@ -30,6 +33,7 @@
 #include "./hash.h"
 #include "./histogram.h"
 #include "./prefix.h"
+#include "./thread_pool.h"
 #include "./utf8_util.h"
 #include "./write_bits.h"
 
@@ -428,9 +432,105 @@ static void WriteMetaBlockInternal(const uint8_t* data,
   }
 }
 
+// Builds and stores a meta-block on a worker thread, for the pipelined mode of
+// BrotliCompressor. It works on its own copy of the input and the commands,
+// so that the compressor can reuse its ring buffer and command buffer for the
+// next input blocks in the meantime.
+class MetaBlockTask {
+ public:
+  MetaBlockTask(const uint8_t* data,
+                const size_t mask,
+                const uint64_t last_flush_pos,
+                const size_t bytes,
+                const bool is_last,
+                const int quality,
+                const bool font_mode,
+                const uint8_t prev_byte,
+                const uint8_t prev_byte2,
+                const size_t num_literals,
+                const size_t num_commands,
+                const Command* commands,
+                const int* saved_dist_cache,
+                const int* dist_cache,
+                const uint8_t last_byte,
+                const uint8_t last_byte_bits)
+      : data_(bytes + 1),
+        bytes_(bytes),
+        is_last_(is_last),
+        quality_(quality),
+        font_mode_(font_mode),
+        prev_byte_(prev_byte),
+        prev_byte2_(prev_byte2),
+        num_literals_(num_literals),
+        commands_(commands, commands + num_commands),
+        storage_(2 * bytes + 500),
+        storage_ix_(last_byte_bits) {
+    // Unwrap the meta-block from the ring buffer.
+    const size_t start = WrapPosition(last_flush_pos) & mask;
+    const size_t head = std::min(bytes, mask + 1 - start);
+    memcpy(&data_[0], &data[start], head);
+    memcpy(&data_[head], &data[0], bytes - head);
+    memcpy(saved_dist_cache_, saved_dist_cache, sizeof(saved_dist_cache_));
+    memcpy(dist_cache_, dist_cache, sizeof(dist_cache_));
+    storage_[0] = last_byte;
+  }
+
+  // Runs the task on a new thread.
+  void Start(void) {
+    thread_ = std::thread(&MetaBlockTask::Run, this);
+  }
+
+  void Wait(void) {
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+  }
+
+  void Run(void) {
+    // The meta-block starts at position zero of the copy, so masking is a
+    // no-op.
+    const size_t mask = std::numeric_limits<uint32_t>::max() >> 1;
+    WriteMetaBlockInternal(&data_[0], mask, 0, bytes_, is_last_, quality_,
+                           font_mode_, prev_byte_, prev_byte2_,
+                           num_literals_, commands_.size(),
+                           commands_.empty() ? NULL : &commands_[0],
+                           saved_dist_cache_, dist_cache_,
+                           &storage_ix_, &storage_[0]);
+  }
+
+  const uint8_t* output(void) const { return &storage_[0]; }
+  size_t output_size(void) const { return storage_ix_ >> 3; }
+  uint8_t last_byte(void) const { return storage_[storage_ix_ >> 3]; }
+  uint8_t last_byte_bits(void) const {
+    return static_cast<uint8_t>(storage_ix_ & 7u);
+  }
+  // The last distances after the meta-block.
+  const int* dist_cache(void) const { return dist_cache_; }
+
+ private:
+  MetaBlockTask(const MetaBlockTask&);
+  MetaBlockTask& operator=(const MetaBlockTask&);
+
+  std::vector<uint8_t> data_;
+  const size_t bytes_;
+  const bool is_last_;
+  const int quality_;
+  const bool font_mode_;
+  const uint8_t prev_byte_;
+  const uint8_t prev_byte2_;
+  const size_t num_literals_;
+  std::vector<Command> commands_;
+  int saved_dist_cache_[4];
+  int dist_cache_[4];
+  std::vector<uint8_t> storage_;
+  size_t storage_ix_;
+  std::thread thread_;
+};
+
 BrotliCompressor::BrotliCompressor(BrotliParams params)
     : params_(params),
       hashers_(new Hashers()),
+      zopfli_seconds_(0),
       input_pos_(0),
       num_commands_(0),
       num_literals_(0),
@@ -445,7 +545,8 @@ BrotliCompressor::BrotliCompressor(BrotliParams params)
       cmd_code_numbits_(0),
       command_buf_(NULL),
       literal_buf_(NULL),
-      is_last_block_emitted_(0) {
+      is_last_block_emitted_(0),
+      pending_metablock_(NULL) {
   // Sanitize params.
   params_.quality = std::max(0, params_.quality);
   if (params_.lgwin < kMinWindowBits) {
@@ -473,7 +574,8 @@ BrotliCompressor::BrotliCompressor(BrotliParams params)
   // read_block_size_bits + 1 bits because the copy tail length needs to be
   // smaller than ringbuffer size.
   int ringbuffer_bits = std::max(params_.lgwin + 1, params_.lgblock + 1);
-  ringbuffer_ = new RingBuffer(ringbuffer_bits, params_.lgblock);
+  ringbuffer_ = new RingBuffer(ringbuffer_bits, params_.lgblock,
+                               params_.use_huge_pages);
 
   commands_ = 0;
   cmd_alloc_size_ = 0;
@@ -498,12 +600,18 @@ BrotliCompressor::BrotliCompressor(BrotliParams params)
     literal_buf_ = new uint8_t[kCompressFragmentTwoPassBlockSize];
   }
 
-  // Initialize hashers.
+  // The hashers are initialized with the first input block, when it may
+  // turn out that the whole input is small.
   hash_type_ = std::min(10, params_.quality);
-  hashers_->Init(hash_type_);
+  hashers_->prefetch_buckets = params_.prefetch_hash_buckets;
+  hashers_->huge_pages = params_.use_huge_pages;
 }
 
 BrotliCompressor::~BrotliCompressor(void) {
+  if (pending_metablock_ != NULL) {
+    pending_metablock_->Wait();
+    delete pending_metablock_;
+  }
   delete[] storage_;
   free(commands_);
   delete ringbuffer_;
@@ -575,9 +683,94 @@ void BrotliCompressor::BrotliSetCustomDictionary(
   if (size > 1) {
     prev_byte2_ = dict[size - 2];
   }
+  hashers_->Init(hash_type_);
+  if (params_.long_distance_matching && hash_type_ < 10) {
+    hashers_->InitLongDistance(params_.lgwin, 0);
+  }
   hashers_->PrependCustomDictionary(hash_type_, params_.lgwin, size, dict);
 }
 
+BrotliCompressorStats BrotliCompressor::stats(void) const {
+  BrotliCompressorStats stats = stats_;
+  HasherStats hasher_stats = hashers_->GetStats(hash_type_);
+  if (stats_.zopfli_budget_exceeded) {
+    // The search of the blocks before the fallback.
+    const HasherStats tree_stats = hashers_->GetStats(10);
+    hasher_stats.num_lookups += tree_stats.num_lookups;
+    hasher_stats.num_comparisons += tree_stats.num_comparisons;
+    hasher_stats.num_dict_lookups += tree_stats.num_dict_lookups;
+    hasher_stats.num_dict_matches += tree_stats.num_dict_matches;
+  }
+  stats.num_hash_lookups = hasher_stats.num_lookups;
+  stats.num_hash_comparisons = hasher_stats.num_comparisons;
+  stats.num_dict_lookups = hasher_stats.num_dict_lookups;
+  stats.num_dict_matches = hasher_stats.num_dict_matches;
+  return stats;
+}
+
+void BrotliCompressor::UpdateStats(size_t metablock_size) {
+  for (size_t i = 0; i < num_commands_; ++i) {
+    const Command& cmd = commands_[i];
+    if (cmd.copy_len() == 0) {
+      continue;
+    }
+    ++stats_.num_copies;
+    stats_.total_copy_length += cmd.copy_len();
+    if (cmd.dist_prefix_ < 16) {
+      ++stats_.num_distance_cache_hits[cmd.dist_prefix_];
+    }
+  }
+  BrotliCompressorStats::MetaBlock metablock;
+  metablock.input_size = metablock_size;
+  metablock.num_literals = num_literals_;
+  metablock.num_commands = num_commands_;
+  stats_.metablocks.push_back(metablock);
+}
+
+void BrotliCompressor::FallBackFromZopfli(void) {
+  stats_.zopfli_budget_exceeded = true;
+  hash_type_ = 9;
+  hashers_->Init(hash_type_);
+  Hashers::H9* hasher = hashers_->hash_h9;
+  hasher->Init();
+  // CreateBackwardReferences stores the last three positions before the next
+  // block itself.
+  const uint8_t* data = ringbuffer_->start();
+  const uint32_t mask = ringbuffer_->mask();
+  const uint32_t end = WrapPosition(input_pos_);
+  const uint32_t window_size = 1u << params_.lgwin;
+  for (uint32_t pos = end > window_size ? end - window_size : 0;
+       pos + 3 < end; ++pos) {
+    hasher->Store(&data[pos & mask], pos);
+  }
+}
+
+MetaBlockTask* BrotliCompressor::FinishPendingMetaBlock(void) {
+  MetaBlockTask* task = pending_metablock_;
+  if (task == NULL) {
+    return NULL;
+  }
+  pending_metablock_ = NULL;
+  task->Wait();
+  last_byte_ = task->last_byte();
+  last_byte_bits_ = task->last_byte_bits();
+  if (memcmp(task->dist_cache(), saved_dist_cache_,
+             sizeof(saved_dist_cache_)) != 0) {
+    // The meta-block was stored uncompressed, so the decoder will not see its
+    // last distances, but the backward references since then were computed
+    // with them.
+    const size_t max_backward_limit = (1 << params_.lgwin) - 16;
+    int dist_cache[4];
+    memcpy(dist_cache, task->dist_cache(), sizeof(dist_cache));
+    RecomputeDistanceCodes(WrapPosition(last_flush_pos_), max_backward_limit,
+                           params_.quality, saved_dist_cache_,
+                           num_commands_, commands_, dist_cache);
+    memcpy(saved_dist_cache_, task->dist_cache(), sizeof(saved_dist_cache_));
+    memcpy(dist_cache_, dist_cache, sizeof(dist_cache_));
+  }
+  return task;
+}
+
 bool BrotliCompressor::WriteBrotliData(const bool is_last,
                                        const bool force_flush,
                                        size_t* out_size,
@@ -646,9 +839,26 @@ bool BrotliCompressor::WriteBrotliData(const bool is_last,
         static_cast<Command*>(realloc(commands_, sizeof(Command) * newsize));
   }
 
+  if (last_processed_pos_ == 0) {
+    // If this is the whole input, the hash tables only need to be large
+    // enough for it, which saves most of the time for small inputs.
+    hashers_->Init(hash_type_, is_last ? bytes : 0);
+    if (params_.long_distance_matching && hash_type_ < 10) {
+      hashers_->InitLongDistance(params_.lgwin, is_last ? bytes : 0);
+    }
+  }
+  const bool zopfli_budget =
+      hash_type_ == 10 && params_.zopfli_time_budget_ms > 0;
+  const std::chrono::steady_clock::time_point start =
+      zopfli_budget ? std::chrono::steady_clock::now()
+                    : std::chrono::steady_clock::time_point();
+  if (stats_.zopfli_budget_exceeded) {
+    ++stats_.num_fallback_blocks;
+  }
   CreateBackwardReferences(bytes, WrapPosition(last_processed_pos_),
                            is_last, data, mask,
-                           params_.quality,
+                           hash_type_ == 10 ? params_.quality
+                                            : std::min(params_.quality, 9),
                            params_.lgwin,
                            hashers_,
                            hash_type_,
@@ -657,6 +867,14 @@ bool BrotliCompressor::WriteBrotliData(const bool is_last,
                            &commands_[num_commands_],
                            &num_commands_,
                            &num_literals_);
+  if (zopfli_budget) {
+    const std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    zopfli_seconds_ += elapsed.count();
+    if (zopfli_seconds_ * 1000 > params_.zopfli_time_budget_ms && !is_last) {
+      FallBackFromZopfli();
+    }
+  }
 
   size_t max_length = std::min<size_t>(mask + 1, 1u << kMaxInputBlockBits);
   const size_t max_literals = max_length / 8;
@@ -683,8 +901,16 @@ bool BrotliCompressor::WriteBrotliData(const bool is_last,
 
   if (!is_last && input_pos_ == last_flush_pos_) {
     // We have no new input data and we don't have to finish the stream, so
-    // nothing to do.
+    // nothing to do, except for returning the pipelined meta-block on a flush.
+    MetaBlockTask* task = force_flush ? FinishPendingMetaBlock() : NULL;
     *out_size = 0;
+    if (task != NULL) {
+      uint8_t* storage = GetBrotliStorage(task->output_size());
+      memcpy(storage, task->output(), task->output_size());
+      *output = &storage[0];
+      *out_size = task->output_size();
+      delete task;
+    }
     return true;
   }
   assert(input_pos_ >= last_flush_pos_);
@@ -692,17 +918,62 @@ bool BrotliCompressor::WriteBrotliData(const bool is_last,
   assert(input_pos_ - last_flush_pos_ <= 1u << 24);
   const uint32_t metablock_size =
       static_cast<uint32_t>(input_pos_ - last_flush_pos_);
-  const size_t max_out_size = 2 * metablock_size + 500;
-  uint8_t* storage = GetBrotliStorage(max_out_size);
-  storage[0] = last_byte_;
-  size_t storage_ix = last_byte_bits_;
   bool font_mode = params_.mode == BrotliParams::MODE_FONT;
-  WriteMetaBlockInternal(
-      data, mask, last_flush_pos_, metablock_size, is_last, params_.quality,
-      font_mode, prev_byte_, prev_byte2_, num_literals_, num_commands_,
-      commands_, saved_dist_cache_, dist_cache_, &storage_ix, storage);
-  last_byte_ = storage[storage_ix >> 3];
-  last_byte_bits_ = storage_ix & 7u;
+  if (params_.pipeline_metablocks) {
+    MetaBlockTask* previous = FinishPendingMetaBlock();
+    // The distance codes are final only after the previous meta-block.
+    UpdateStats(metablock_size);
+    if (metablock_size > 0 &&
+        !ShouldCompress(data, mask, last_flush_pos_, metablock_size,
+                        num_literals_, num_commands_)) {
+      // WriteMetaBlockInternal will restore the distance cache, and the
+      // next input blocks have to see that.
+      memcpy(dist_cache_, saved_dist_cache_, sizeof(dist_cache_));
+    }
+    MetaBlockTask* task = new MetaBlockTask(
+        data, mask, last_flush_pos_, metablock_size, is_last, params_.quality,
+        font_mode, prev_byte_, prev_byte2_, num_literals_, num_commands_,
+        commands_, saved_dist_cache_, dist_cache_, last_byte_, last_byte_bits_);
+    MetaBlockTask* finished = NULL;
+    if (is_last || force_flush) {
+      // The caller wants all output now, so there is nothing to overlap.
+      task->Run();
+      last_byte_ = task->last_byte();
+      last_byte_bits_ = task->last_byte_bits();
+      memcpy(dist_cache_, task->dist_cache(), sizeof(dist_cache_));
+      finished = task;
+    } else {
+      task->Start();
+      pending_metablock_ = task;
+    }
+    const size_t previous_size = previous ? previous->output_size() : 0;
+    const size_t finished_size = finished ? finished->output_size() : 0;
+    uint8_t* storage = GetBrotliStorage(previous_size + finished_size);
+    if (previous != NULL) {
+      memcpy(storage, previous->output(), previous_size);
+    }
+    if (finished != NULL) {
+      memcpy(&storage[previous_size], finished->output(), finished_size);
+    }
+    delete previous;
+    delete finished;
+    *output = &storage[0];
+    *out_size = previous_size + finished_size;
+  } else {
+    UpdateStats(metablock_size);
+    const size_t max_out_size = 2 * metablock_size + 500;
+    uint8_t* storage = GetBrotliStorage(max_out_size);
+    storage[0] = last_byte_;
+    size_t storage_ix = last_byte_bits_;
+    WriteMetaBlockInternal(
+        data, mask, last_flush_pos_, metablock_size, is_last, params_.quality,
+        font_mode, prev_byte_, prev_byte2_, num_literals_, num_commands_,
+        commands_, saved_dist_cache_, dist_cache_, &storage_ix, storage);
+    last_byte_ = storage[storage_ix >> 3];
+    last_byte_bits_ = storage_ix & 7u;
+    *output = &storage[0];
+    *out_size = storage_ix >> 3;
+  }
   last_flush_pos_ = input_pos_;
   last_processed_pos_ = input_pos_;
   if (last_flush_pos_ > 0) {
@@ -716,8 +987,6 @@ bool BrotliCompressor::WriteBrotliData(const bool is_last,
   // Save the state of the distance cache in case we need to restore it for
   // emitting an uncompressed block.
   memcpy(saved_dist_cache_, dist_cache_, sizeof(dist_cache_));
-  *output = &storage[0];
-  *out_size = storage_ix >> 3;
   return true;
 }
 
@@ -794,7 +1063,212 @@ bool BrotliCompressor::FinishStream(
   return WriteMetaBlock(0, NULL, true, encoded_size, encoded_buffer);
 }
 
-static int BrotliCompressBufferQuality10(int lgwin,
+// Zopfli input block of the multi-threaded compressor, see
+// ZopfliBlockPipeline below.
+class ZopfliBlockTask : public ThreadPoolTask {
+ public:
+  ZopfliBlockTask(const uint8_t* input_buffer,
+                  size_t mask,
+                  size_t max_backward_limit,
+                  size_t num_iterations,
+                  size_t block_start,
+                  size_t block_size,
+                  const int* dist_cache)
+      : input_buffer_(input_buffer),
+        mask_(mask),
+        max_backward_limit_(max_backward_limit),
+        num_iterations_(num_iterations),
+        block_start_(block_start),
+        block_size_(block_size) {
+    memcpy(dist_cache_, dist_cache, sizeof(dist_cache_));
+  }
+
+  void Run(void) {
+    ZopfliComputeShortestPath(block_size_, block_start_, input_buffer_, mask_,
+                              max_backward_limit_, dist_cache_,
+                              num_iterations_, num_matches_, matches_,
+                              &model_, &nodes_, &path_);
+    // Release the matches early, they are the bulk of the memory of a block.
+    std::vector<uint32_t>().swap(num_matches_);
+    std::vector<BackwardMatch>().swap(matches_);
+  }
+
+  size_t block_start(void) const { return block_start_; }
+  size_t block_size(void) const { return block_size_; }
+  // The last four distances that the shortest path search assumed at the
+  // beginning of the block.
+  const int* dist_cache(void) const { return dist_cache_; }
+  std::vector<uint32_t>* num_matches(void) { return &num_matches_; }
+  std::vector<BackwardMatch>* matches(void) { return &matches_; }
+  const ZopfliNodes& nodes(void) const { return nodes_; }
+  std::vector<uint32_t>* path(void) { return &path_; }
+
+ private:
+  const uint8_t* input_buffer_;
+  const size_t mask_;
+  const size_t max_backward_limit_;
+  const size_t num_iterations_;
+  const size_t block_start_;
+  const size_t block_size_;
+  int dist_cache_[4];
+  std::vector<uint32_t> num_matches_;
+  std::vector<BackwardMatch> matches_;
+  // The blocks run concurrently, so each has its own cost model and nodes.
+  ZopfliCostModel model_;
+  ZopfliNodes nodes_;
+  std::vector<uint32_t> path_;
+};
+
+// Predicts the last four distances at the end of a block from the longest
+// matches found in it, since the shortest path tends to end with some of
+// them. dist_cache holds the prediction for the beginning of the block.
+static void PredictDistanceCache(size_t block_start,
+                                 size_t block_size,
+                                 size_t max_backward_limit,
+                                 const std::vector<uint32_t>& num_matches,
+                                 const std::vector<BackwardMatch>& matches,
+                                 int* dist_cache) {
+  size_t cur_match_pos = 0;
+  for (size_t i = 0; i < block_size; ++i) {
+    if (num_matches[i] == 0) {
+      continue;
+    }
+    cur_match_pos += num_matches[i];
+    const size_t distance = matches[cur_match_pos - 1].distance;
+    const size_t max_distance = std::min(block_start + i, max_backward_limit);
+    if (distance <= max_distance &&
+        distance != static_cast<size_t>(dist_cache[0])) {
+      dist_cache[3] = dist_cache[2];
+      dist_cache[2] = dist_cache[1];
+      dist_cache[1] = dist_cache[0];
+      dist_cache[0] = static_cast<int>(distance);
+    }
+  }
+}
+
+// Computes the shortest paths of the input blocks for the multi-threaded
+// quality 10 and 11 compressor. Finding the matches depends on the hasher
+// state after all previous blocks, so it is done on the calling thread, but
+// the shortest path search of up to num_threads blocks runs on the thread
+// pool, while the matches of the next blocks are being found.
+// The search of a block can not wait for the last distances of the previous
+// block, so it starts from the distances predicted by PredictDistanceCache()
+// and ZopfliCreateCommands() repairs the first distance codes of the block.
+// The prediction only depends on the input, so the output does not depend on
+// the number of threads.
+class ZopfliBlockPipeline {
+ public:
+  ZopfliBlockPipeline(int quality,
+                      int lgwin,
+                      size_t input_size,
+                      const uint8_t* input_buffer,
+                      size_t mask,
+                      size_t max_block_size,
+                      int num_threads,
+                      bool huge_pages)
+      : input_size_(input_size),
+        input_buffer_(input_buffer),
+        mask_(mask),
+        max_backward_limit_((static_cast<size_t>(1) << lgwin) - 16),
+        num_iterations_(quality > 10 ? 2 : 1),
+        max_block_size_(max_block_size),
+        hasher_(new Hashers::H10(huge_pages)),
+        pool_(num_threads),
+        next_block_start_(0) {
+    const size_t hasher_eff_size =
+        std::min(input_size, max_backward_limit_ + 16);
+    hasher_->Init(lgwin, 0, hasher_eff_size, true);
+    next_dist_cache_[0] = 4;
+    next_dist_cache_[1] = 11;
+    next_dist_cache_[2] = 15;
+    next_dist_cache_[3] = 16;
+  }
+
+  ~ZopfliBlockPipeline(void) {
+    for (size_t i = 0; i < ready_.size(); ++i) {
+      delete ready_[i];
+    }
+    for (size_t i = 0; i < pending_.size(); ++i) {
+      delete pending_[i];
+    }
+    delete hasher_;
+  }
+
+  // Returns the next block in input order with its shortest path computed,
+  // or NULL after the last block. The caller takes ownership of the block.
+  ZopfliBlockTask* Next(void) {
+    if (ready_.empty()) {
+      if (pending_.empty()) {
+        FindMatchesOfNextBatch();
+      }
+      std::vector<ZopfliBlockTask*> running;
+      running.swap(pending_);
+      for (size_t i = 0; i < running.size(); ++i) {
+        pool_.Schedule(running[i]);
+      }
+      FindMatchesOfNextBatch();
+      pool_.Wait();
+      ready_.assign(running.begin(), running.end());
+    }
+    if (ready_.empty()) {
+      return NULL;
+    }
+    ZopfliBlockTask* block = ready_.front();
+    ready_.pop_front();
+    return block;
+  }
+
+ private:
+  ZopfliBlockPipeline(const ZopfliBlockPipeline&);
+  ZopfliBlockPipeline& operator=(const ZopfliBlockPipeline&);
+
+  void FindMatchesOfNextBatch(void) {
+    while (pending_.size() < static_cast<size_t>(pool_.num_threads()) &&
+           next_block_start_ < input_size_) {
+      const size_t block_start = next_block_start_;
+      const size_t block_size =
+          std::min(input_size_ - block_start, max_block_size_);
+      ZopfliBlockTask* block = new ZopfliBlockTask(
+          input_buffer_, mask_, max_backward_limit_, num_iterations_,
+          block_start, block_size, next_dist_cache_);
+      hasher_->StitchToPreviousBlock(block_size, block_start,
+                                     input_buffer_, mask_);
+      ZopfliFindAllMatches(block_size, block_start, input_buffer_, mask_,
+                           max_backward_limit_, hasher_,
+                           block->num_matches(), block->matches());
+      PredictDistanceCache(block_start, block_size, max_backward_limit_,
+                           *block->num_matches(), *block->matches(),
+                           next_dist_cache_);
+      pending_.push_back(block);
+      next_block_start_ += block_size;
+    }
+  }
+
+  const size_t input_size_;
+  const uint8_t* input_buffer_;
+  const size_t mask_;
+  const size_t max_backward_limit_;
+  const size_t num_iterations_;
+  const size_t max_block_size_;
+  Hashers::H10* hasher_;
+  ThreadPool pool_;
+  size_t next_block_start_;
+  // Predicted last distances at next_block_start_.
+  int next_dist_cache_[4];
+  // Blocks whose matches are found, but the shortest path is not.
+  std::vector<ZopfliBlockTask*> pending_;
+  // Blocks with their shortest paths computed.
+  std::deque<ZopfliBlockTask*> ready_;
+};
+
+// Compresses the input with zopfli at the given quality. If num_threads is
+// zero, the blocks are compressed one after the other on the calling thread
+// with quality 10, otherwise with a ZopfliBlockPipeline of num_threads
+// threads.
+static int BrotliCompressBufferQuality10(int quality,
+                                         int lgwin,
+                                         int num_threads,
+                                         bool huge_pages,
                                          size_t input_size,
                                          const uint8_t* input_buffer,
                                          size_t* encoded_size,
@@ -811,16 +1285,28 @@ static int BrotliCompressBufferQuality10(int lgwin,
   uint8_t last_byte_bits;
   EncodeWindowBits(lgwin, &last_byte, &last_byte_bits);
 
-  Hashers::H10* hasher = new Hashers::H10;
-  const size_t hasher_eff_size = std::min(input_size, max_backward_limit + 16);
-  hasher->Init(lgwin, 0, hasher_eff_size, true);
-
   const int lgblock = std::min(18, lgwin);
   const int lgmetablock = std::min(24, lgwin + 1);
   const size_t max_block_size = static_cast<size_t>(1) << lgblock;
   const size_t max_metablock_size = static_cast<size_t>(1) << lgmetablock;
   const size_t max_literals_per_metablock = max_metablock_size / 8;
   const size_t max_commands_per_metablock = max_metablock_size / 8;
+
+  Hashers::H10* hasher = NULL;
+  ZopfliCostModel model;
+  ZopfliNodes nodes;
+  ZopfliBlockPipeline* pipeline = NULL;
+  if (num_threads == 0) {
+    hasher = new Hashers::H10(huge_pages);
+    const size_t hasher_eff_size =
+        std::min(input_size, max_backward_limit + 16);
+    hasher->Init(lgwin, 0, hasher_eff_size, true);
+  } else {
+    pipeline = new ZopfliBlockPipeline(quality, lgwin, input_size,
+                                       input_buffer, mask, max_block_size,
+                                       num_threads, huge_pages);
+  }
+
   size_t metablock_start = 0;
   uint8_t prev_byte = 0;
   uint8_t prev_byte2 = 0;
@@ -838,13 +1324,25 @@ static int BrotliCompressBufferQuality10(int lgwin,
 
     for (size_t block_start = metablock_start; block_start < metablock_end; ) {
       size_t block_size = std::min(metablock_end - block_start, max_block_size);
-      ZopfliNode* nodes = new ZopfliNode[block_size + 1];
+      ZopfliBlockTask* block = NULL;
+      const int* path_dist_cache = dist_cache;
       std::vector<uint32_t> path;
-      hasher->StitchToPreviousBlock(block_size, block_start,
-                                    input_buffer, mask);
-      ZopfliComputeShortestPath(block_size, block_start, input_buffer, mask,
-                                max_backward_limit, dist_cache,
-                                hasher, nodes, &path);
+      if (pipeline == NULL) {
+        hasher->StitchToPreviousBlock(block_size, block_start,
+                                      input_buffer, mask);
+        ZopfliComputeShortestPath(block_size, block_start, input_buffer, mask,
+                                  max_backward_limit, dist_cache,
+                                  hasher, &model, &nodes, &path);
+      } else {
+        // Metablocks always end at a block boundary, so the blocks of the
+        // pipeline are the same as the ones here.
+        block = pipeline->Next();
+        assert(block != NULL);
+        assert(block->block_start() == block_start);
+        assert(block->block_size() == block_size);
+        path.swap(*block->path());
+        path_dist_cache = block->dist_cache();
+      }
       // We allocate a command buffer in the first iteration of this loop that
       // will be likely big enough for the whole metablock, so that for most
       // inputs we will not have to reallocate in later iterations. We do the
@@ -861,12 +1359,13 @@ static int BrotliCompressBufferQuality10(int lgwin,
             realloc(commands, cmd_alloc_size * sizeof(Command)));
       }
       ZopfliCreateCommands(block_size, block_start, max_backward_limit, path,
-                           &nodes[0], dist_cache, &last_insert_len,
+                           block != NULL ? block->nodes() : nodes,
+                           path_dist_cache, dist_cache, &last_insert_len,
                            &commands[num_commands], &num_literals);
       num_commands += path.size();
       block_start += block_size;
       metablock_size += block_size;
-      delete[] nodes;
+      delete block;
       if (num_literals > max_literals_per_metablock ||
           num_commands > max_commands_per_metablock) {
         break;
@@ -913,6 +1412,7 @@ static int BrotliCompressBufferQuality10(int lgwin,
                      prev_byte, prev_byte2,
                      commands, num_commands,
                      literal_context_mode,
+                     num_threads,
                      &mb);
       OptimizeHistograms(num_direct_distance_codes,
                          distance_postfix_bits,
@@ -961,6 +1461,7 @@ static int BrotliCompressBufferQuality10(int lgwin,
   }
 
   *encoded_size = total_out_size;
+  delete pipeline;
   delete hasher;
   return ok;
 }
@@ -980,10 +1481,11 @@ int BrotliCompressBuffer(BrotliParams params,
     *encoded_buffer = 6;
     return 1;
   }
-  if (params.quality == 10) {
+  if (params.quality == 10 && params.zopfli_time_budget_ms <= 0) {
     // TODO: Implement this direct path for all quality levels.
     const int lgwin = std::min(24, std::max(16, params.lgwin));
-    return BrotliCompressBufferQuality10(lgwin, input_size, input_buffer,
+    return BrotliCompressBufferQuality10(10, lgwin, 0, params.use_huge_pages,
+                                         input_size, input_buffer,
                                          encoded_size, encoded_buffer);
   }
   BrotliMemIn in(input_buffer, input_size);
@@ -995,6 +1497,28 @@ int BrotliCompressBuffer(BrotliParams params,
   return 1;
 }
 
+int BrotliCompressBufferParallelZopfli(BrotliParams params,
+                                       size_t input_size,
+                                       const uint8_t* input_buffer,
+                                       size_t* encoded_size,
+                                       uint8_t* encoded_buffer,
+                                       int num_threads) {
+  if (params.quality < 10 || input_size == 0) {
+    return BrotliCompressBuffer(params, input_size, input_buffer,
+                                encoded_size, encoded_buffer);
+  }
+  if (*encoded_size == 0) {
+    // Output buffer needs at least one byte.
+    return 0;
+  }
+  const int lgwin = std::min(24, std::max(16, params.lgwin));
+  return BrotliCompressBufferQuality10(std::min(11, params.quality), lgwin,
+                                       std::max(1, num_threads),
+                                       params.use_huge_pages,
+                                       input_size, input_buffer,
+                                       encoded_size, encoded_buffer);
+}
+
 static bool BrotliInIsFinished(BrotliIn* r) {
   size_t read_bytes;
   return r->Read(0, &read_bytes) == NULL;
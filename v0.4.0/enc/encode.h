@@ -20,6 +20,8 @@
 
 namespace brotli {
 
+class MetaBlockTask;
+
 static const int kMaxWindowBits = 24;
 static const int kMinWindowBits = 10;
 static const int kMinInputBlockBits = 16;
@@ -31,6 +33,11 @@ struct BrotliParams {
         quality(11),
         lgwin(22),
         lgblock(0),
+        pipeline_metablocks(false),
+        prefetch_hash_buckets(true),
+        long_distance_matching(false),
+        use_huge_pages(true),
+        zopfli_time_budget_ms(0),
         enable_dictionary(true),
         enable_transforms(false),
         greedy_block_split(false),
@@ -55,6 +62,38 @@ struct BrotliParams {
   // Base 2 logarithm of the maximum input block size. Range is 16 to 24.
   // If set to 0, the value will be set based on the quality.
   int lgblock;
+  // If true, BrotliCompressor builds and stores each meta-block on a worker
+  // thread, while the backward references of the next input blocks are
+  // computed on the calling thread. The output is the same, except after a
+  // meta-block that turned out to be too large to compress, where the next
+  // meta-block is based on slightly different backward references.
+  // Ignored for quality 0 and 1.
+  bool pipeline_metablocks;
+  // If true, the hash table entries needed for the match search at the next
+  // positions are prefetched while searching at the current position. This
+  // does not change the output. Ignored for quality 0, 1, 10 and 11.
+  bool prefetch_hash_buckets;
+  // If true, the backward reference search also looks for repeats of long
+  // sections, at least 64 bytes, anywhere in the window, which the regular
+  // hash tables of quality 2 to 9 forget after a few megabytes at most.
+  // Uses one 8 byte table entry per 64 bytes of the window. Ignored for
+  // quality 0, 1, 10 and 11, and by the parallel compressors.
+  bool long_distance_matching;
+  // If true, the hash tables and the ring buffer of a few megabytes or more
+  // are backed by transparent huge pages where the system supports them,
+  // which makes their random accesses cause fewer TLB misses. This does not
+  // change the output.
+  bool use_huge_pages;
+  // If positive, the wall clock time in milliseconds that the shortest path
+  // search of quality 10 and 11 may take in total for a stream. The time is
+  // checked after each input block, so the search can overrun the budget by
+  // one input block. After that, the rest of the stream is searched like
+  // quality 9, which takes a small fraction of the time, and
+  // BrotliCompressorStats::zopfli_budget_exceeded is set. With a budget,
+  // BrotliCompressBuffer() compresses quality 10 with a BrotliCompressor,
+  // like quality 11. Zero means no limit. Ignored below quality 10 and by
+  // BrotliCompressBufferParallelZopfli().
+  int zopfli_time_budget_ms;
 
   // These settings are deprecated and will be ignored.
   // All speed vs. size compromises are controlled by the quality param.
@@ -64,6 +103,54 @@ struct BrotliParams {
   bool enable_context_modeling;
 };
 
+// Counters of the backward reference search of a BrotliCompressor, and the
+// commands it produced, since the start of the stream.
+struct BrotliCompressorStats {
+  BrotliCompressorStats(void)
+      : num_hash_lookups(0),
+        num_hash_comparisons(0),
+        num_dict_lookups(0),
+        num_dict_matches(0),
+        num_copies(0),
+        total_copy_length(0),
+        zopfli_budget_exceeded(false),
+        num_fallback_blocks(0) {
+    for (int i = 0; i < 16; ++i) {
+      num_distance_cache_hits[i] = 0;
+    }
+  }
+
+  struct MetaBlock {
+    // Number of input bytes, literals and commands, including the final
+    // insert-only command, of the meta-block.
+    size_t input_size;
+    size_t num_literals;
+    size_t num_commands;
+  };
+
+  // Positions whose matches were searched in the hash table, and the earlier
+  // positions whose data was compared with theirs.
+  size_t num_hash_lookups;
+  size_t num_hash_comparisons;
+  // Lookups of the static dictionary, and the ones that found a match.
+  size_t num_dict_lookups;
+  size_t num_dict_matches;
+  // Number of commands with a backward reference or a dictionary word, and
+  // the sum of their copy lengths.
+  size_t num_copies;
+  size_t total_copy_length;
+  // Number of commands whose distance is coded with each of the 16 short
+  // codes, i.e. found at the last distance kDistanceCacheIndex[i] plus
+  // kDistanceCacheOffset[i] of hash.h.
+  size_t num_distance_cache_hits[16];
+  // True if the shortest path search of quality 10 and 11 took longer than
+  // BrotliParams::zopfli_time_budget_ms, and the number of input blocks that
+  // were searched like quality 9 after that.
+  bool zopfli_budget_exceeded;
+  size_t num_fallback_blocks;
+  std::vector<MetaBlock> metablocks;
+};
+
 // An instance can not be reused for multiple brotli streams.
 class BrotliCompressor {
  public:
@@ -131,9 +218,27 @@ class BrotliCompressor {
   // No-op, but we keep it here for API backward-compatibility.
   void WriteStreamHeader(void) {}
 
+  // Returns the counters of the stream so far. The meta-blocks are counted
+  // when they are written. Quality 0 and 1 do not collect any counters.
+  BrotliCompressorStats stats(void) const;
+
  private:
   uint8_t* GetBrotliStorage(size_t size);
 
+  // Adds the commands collected since the last meta-block to stats_.
+  void UpdateStats(size_t metablock_size);
+
+  // Switches the backward reference search of quality 10 and 11 to the one
+  // of quality 9 for the rest of the stream, with the hash table filled
+  // from the window before the next input block.
+  void FallBackFromZopfli(void);
+
+  // Waits for the meta-block that is being written on the worker thread in
+  // pipelined mode, if any, and repairs the distance codes of the commands
+  // collected since then if the meta-block has changed the last distances.
+  // Returns the finished task, or NULL.
+  MetaBlockTask* FinishPendingMetaBlock(void);
+
   // Allocates and clears a hash table using memory in "*this",
   // stores the number of buckets in "*table_size" and returns a pointer to
   // the base of the hash table.
@@ -143,6 +248,9 @@ class BrotliCompressor {
   BrotliParams params_;
   Hashers* hashers_;
   int hash_type_;
+  // Time spent so far in the shortest path search, if there is a time
+  // budget for it.
+  double zopfli_seconds_;
   uint64_t input_pos_;
   RingBuffer* ringbuffer_;
   size_t cmd_alloc_size_;
@@ -182,6 +290,9 @@ class BrotliCompressor {
   uint8_t* literal_buf_;
   
   int is_last_block_emitted_;
+  // Meta-block that is being written on the worker thread in pipelined mode.
+  MetaBlockTask* pending_metablock_;
+  BrotliCompressorStats stats_;
 };
 
 // Compresses the data in input_buffer into encoded_buffer, and sets
@@ -193,8 +304,21 @@ int BrotliCompressBuffer(BrotliParams params,
                          size_t* encoded_size,
                          uint8_t* encoded_buffer);
 
-// Same as above, but uses the specified input and output classes instead
-// of reading from and writing to pre-allocated memory buffers.
+// Same as above, but for quality 10 and 11 the shortest path search runs for
+// up to num_threads input blocks at the same time, and the block splitting and
+// clustering of each meta-block is spread over num_threads threads. The output
+// does not depend on num_threads, but it can be slightly larger than that of
+// BrotliCompressBuffer, since every block starts from predicted last distances
+// instead of the ones at the end of the previous block.
+int BrotliCompressBufferParallelZopfli(BrotliParams params,
+                                       size_t input_size,
+                                       const uint8_t* input_buffer,
+                                       size_t* encoded_size,
+                                       uint8_t* encoded_buffer,
+                                       int num_threads);
+
+// Same as BrotliCompressBuffer, but uses the specified input and output
+// classes instead of reading from and writing to pre-allocated memory buffers.
 int BrotliCompress(BrotliParams params, BrotliIn* in, BrotliOut* out);
 
 // Before compressing the data, sets a custom LZ77 dictionary with
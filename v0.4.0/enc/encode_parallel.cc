@@ -8,8 +8,13 @@
 
 #include "./encode_parallel.h"
 
+#include <time.h>
+
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <limits>
+#include <mutex>
 
 #include "./backward_references.h"
 #include "./bit_cost.h"
@@ -24,6 +29,7 @@
 #include "./hash.h"
 #include "./histogram.h"
 #include "./prefix.h"
+#include "./thread_pool.h"
 #include "./utf8_util.h"
 #include "./write_bits.h"
 
@@ -50,44 +56,115 @@ void RecomputeDistancePrefixes(Command* cmds, size_t num_commands,
   }
 }
 
+// CreateBackwardReferences reads up to 3 bytes past the end of input if the
+// mask points past the end of input.
+// FindMatchLengthWithLimit could do another 8 bytes look-forward.
+static const size_t kInputSlackBytes = 4 + 8;
+
+// Keeps the hashers of finished blocks for reuse by later blocks. Since
+// every worker thread holds at most one of them at a time, no more than one
+// set of hash tables per thread is ever allocated, and starting a new block
+// only has to reset the tables instead of allocating and zeroing new ones.
+class HashersCache {
+ public:
+  HashersCache(int hash_type, bool prefetch_buckets, bool huge_pages)
+      : hash_type_(hash_type), prefetch_buckets_(prefetch_buckets),
+        huge_pages_(huge_pages) {}
+
+  ~HashersCache(void) {
+    for (size_t i = 0; i < free_.size(); ++i) {
+      delete free_[i];
+    }
+  }
+
+  // Returns a hasher set that is ready for a new stream.
+  Hashers* Acquire(void) {
+    Hashers* hashers = NULL;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (!free_.empty()) {
+        hashers = free_.back();
+        free_.pop_back();
+      }
+    }
+    if (hashers == NULL) {
+      hashers = new Hashers();
+      hashers->huge_pages = huge_pages_;
+    }
+    hashers->Init(hash_type_);
+    hashers->prefetch_buckets = prefetch_buckets_;
+    return hashers;
+  }
+
+  void Release(Hashers* hashers) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    free_.push_back(hashers);
+  }
+
+ private:
+  HashersCache(const HashersCache&);
+  HashersCache& operator=(const HashersCache&);
+
+  const int hash_type_;
+  const bool prefetch_buckets_;
+  const bool huge_pages_;
+  std::mutex mutex_;
+  std::vector<Hashers*> free_;
+};
+
+int ParallelHashType(const BrotliParams& params) {
+  return std::min(10, params.quality);
+}
+
+// Compresses input_buffer[0..input_size) into a meta-block, using the
+// prefix_size bytes before it as the sliding window. The prefix must be
+// stored directly in front of the input, i.e.
+// prefix_buffer + prefix_size == input_buffer, and tail_size is the number
+// of readable bytes after the input. If there are at least
+// kInputSlackBytes of them, the block is compressed in place, otherwise the
+// prefix, the input and the tail are copied into a zero-padded area.
+// The hashers must have been initialized for a new stream of the hash type
+// returned by ParallelHashType().
 bool WriteMetaBlockParallel(const BrotliParams& params,
                             const uint32_t input_size,
                             const uint8_t* input_buffer,
                             const uint32_t prefix_size,
                             const uint8_t* prefix_buffer,
+                            const size_t tail_size,
                             const bool is_first,
                             const bool is_last,
+                            Hashers* hashers,
                             size_t* encoded_size,
                             uint8_t* encoded_buffer) {
   if (input_size == 0) {
     return false;
   }
+  assert(prefix_buffer + prefix_size == input_buffer);
 
-  // Copy prefix + next input block into a continuous area.
   uint32_t input_pos = prefix_size;
-  // CreateBackwardReferences reads up to 3 bytes past the end of input if the
-  // mask points past the end of input.
-  // FindMatchLengthWithLimit could do another 8 bytes look-forward.
-  std::vector<uint8_t> input(prefix_size + input_size + 4 + 8);
-  memcpy(&input[0], prefix_buffer, prefix_size);
-  memcpy(&input[input_pos], input_buffer, input_size);
+  const uint8_t* data = prefix_buffer;
+  std::vector<uint8_t> padded_input;
+  if (tail_size < kInputSlackBytes) {
+    // Copy prefix + next input block + tail into a continuous area.
+    padded_input.resize(prefix_size + input_size + kInputSlackBytes);
+    memcpy(&padded_input[0], prefix_buffer,
+           prefix_size + input_size + tail_size);
+    data = &padded_input[0];
+  }
   // Since we don't have a ringbuffer, masking is a no-op.
   // We use one less bit than the full range because some of the code uses
   // mask + 1 as the size of the ringbuffer.
   const uint32_t mask = std::numeric_limits<uint32_t>::max() >> 1;
 
-  uint8_t prev_byte = input_pos > 0 ? input[(input_pos - 1) & mask] : 0;
-  uint8_t prev_byte2 = input_pos > 1 ? input[(input_pos - 2) & mask] : 0;
+  uint8_t prev_byte = input_pos > 0 ? data[(input_pos - 1) & mask] : 0;
+  uint8_t prev_byte2 = input_pos > 1 ? data[(input_pos - 2) & mask] : 0;
 
   // Decide about UTF8 mode.
   static const double kMinUTF8Ratio = 0.75;
-  bool utf8_mode = IsMostlyUTF8(&input[0], input_pos, mask, input_size,
+  bool utf8_mode = IsMostlyUTF8(data, input_pos, mask, input_size,
                                 kMinUTF8Ratio);
 
-  // Initialize hashers.
-  int hash_type = std::min(10, params.quality);
-  Hashers* hashers = new Hashers();
-  hashers->Init(hash_type);
+  int hash_type = ParallelHashType(params);
 
   // Compute backward references.
   size_t last_insert_len = 0;
@@ -97,12 +174,11 @@ bool WriteMetaBlockParallel(const BrotliParams& params,
   Command* commands = static_cast<Command*>(
       malloc(sizeof(Command) * ((input_size + 1) >> 1)));
   if (commands == 0) {
-    delete hashers;
     return false;
   }
   CreateBackwardReferences(
       input_size, input_pos, is_last,
-      &input[0], mask,
+      data, mask,
       params.quality,
       params.lgwin,
       hashers,
@@ -112,7 +188,6 @@ bool WriteMetaBlockParallel(const BrotliParams& params,
       commands,
       &num_commands,
       &num_literals);
-  delete hashers;
   if (last_insert_len > 0) {
     commands[num_commands++] = Command(last_insert_len);
     num_literals += last_insert_len;
@@ -130,11 +205,11 @@ bool WriteMetaBlockParallel(const BrotliParams& params,
                             num_direct_distance_codes,
                             distance_postfix_bits);
   if (params.quality <= 9) {
-    BuildMetaBlockGreedy(&input[0], input_pos, mask,
+    BuildMetaBlockGreedy(data, input_pos, mask,
                          commands, num_commands,
                          &mb);
   } else {
-    BuildMetaBlock(&input[0], input_pos, mask,
+    BuildMetaBlock(data, input_pos, mask,
                    prev_byte, prev_byte2,
                    commands, num_commands,
                    literal_context_mode,
@@ -162,7 +237,7 @@ bool WriteMetaBlockParallel(const BrotliParams& params,
   size_t storage_ix = first_byte_bits;
 
   // Store the meta-block to the temporary output.
-  StoreMetaBlock(&input[0], input_pos, input_size, mask,
+  StoreMetaBlock(data, input_pos, input_size, mask,
                  prev_byte, prev_byte2,
                  is_last,
                  num_direct_distance_codes,
@@ -185,7 +260,7 @@ bool WriteMetaBlockParallel(const BrotliParams& params,
   if (input_size + 4 < output_size) {
     storage[0] = static_cast<uint8_t>(first_byte);
     storage_ix = first_byte_bits;
-    StoreUncompressedMetaBlock(is_last, &input[0], input_pos, mask,
+    StoreUncompressedMetaBlock(is_last, data, input_pos, mask,
                                input_size,
                                &storage_ix, &storage[0]);
     output_size = storage_ix >> 3;
@@ -200,6 +275,303 @@ bool WriteMetaBlockParallel(const BrotliParams& params,
   return true;
 }
 
+// Compresses one input block of the parallel compressor into its own
+// byte-aligned meta-block. The blocks do not share any state, so the tasks
+// can run in any order and the output does not depend on the thread count.
+class CompressBlockTask : public ThreadPoolTask {
+ public:
+  CompressBlockTask(const BrotliParams& params,
+                    uint32_t input_block_size,
+                    const uint8_t* input_block,
+                    uint32_t prefix_size,
+                    const uint8_t* prefix,
+                    size_t tail_size,
+                    bool is_first,
+                    bool is_last,
+                    HashersCache* hashers_cache)
+      : params_(params),
+        input_block_size_(input_block_size),
+        input_block_(input_block),
+        prefix_size_(prefix_size),
+        prefix_(prefix),
+        tail_size_(tail_size),
+        is_first_(is_first),
+        is_last_(is_last),
+        hashers_cache_(hashers_cache),
+        ok_(false) {}
+
+  void Run(void) {
+    size_t out_size = input_block_size_ + (input_block_size_ >> 3) + 1024;
+    out_.resize(out_size);
+    Hashers* hashers = hashers_cache_->Acquire();
+    ok_ = WriteMetaBlockParallel(params_,
+                                 input_block_size_,
+                                 input_block_,
+                                 prefix_size_,
+                                 prefix_,
+                                 tail_size_,
+                                 is_first_,
+                                 is_last_,
+                                 hashers,
+                                 &out_size,
+                                 &out_[0]);
+    hashers_cache_->Release(hashers);
+    out_.resize(ok_ ? out_size : 0);
+  }
+
+  bool ok(void) const { return ok_; }
+  const std::vector<uint8_t>& output(void) const { return out_; }
+
+ private:
+  const BrotliParams& params_;
+  const uint32_t input_block_size_;
+  const uint8_t* input_block_;
+  const uint32_t prefix_size_;
+  const uint8_t* prefix_;
+  const size_t tail_size_;
+  const bool is_first_;
+  const bool is_last_;
+  HashersCache* hashers_cache_;
+  bool ok_;
+  std::vector<uint8_t> out_;
+};
+
+void SanitizeParams(BrotliParams* params) {
+  if (params->lgwin < kMinWindowBits) {
+    params->lgwin = kMinWindowBits;
+  } else if (params->lgwin > kMaxWindowBits) {
+    params->lgwin = kMaxWindowBits;
+  }
+  if (params->lgblock == 0) {
+    params->lgblock = 16;
+    if (params->quality >= 9 && params->lgwin > params->lgblock) {
+      params->lgblock = std::min(21, params->lgwin);
+    }
+  } else if (params->lgblock < kMinInputBlockBits) {
+    params->lgblock = kMinInputBlockBits;
+  } else if (params->lgblock > kMaxInputBlockBits) {
+    params->lgblock = kMaxInputBlockBits;
+  }
+}
+
+void RunTasks(const std::vector<CompressBlockTask*>& tasks, ThreadPool* pool) {
+  for (size_t i = 0; i < tasks.size(); ++i) {
+    pool->Schedule(tasks[i]);
+  }
+  pool->Wait();
+}
+
+// Reads exactly n bytes to dst, unless the end of the input is reached first.
+// Sets *bytes_read to the number of bytes read and *is_last to true if no
+// input is left after them. Returns false on a read error.
+bool ReadInputBlock(BrotliIn* in, size_t n, uint8_t* dst,
+                    size_t* bytes_read, bool* is_last) {
+  *bytes_read = 0;
+  *is_last = false;
+  while (*bytes_read < n) {
+    size_t chunk_size = 0;
+    const void* chunk = in->Read(n - *bytes_read, &chunk_size);
+    if (chunk == NULL) {
+      *is_last = true;
+      return true;
+    }
+    if (chunk_size > n - *bytes_read) {
+      return false;
+    }
+    memcpy(&dst[*bytes_read], chunk, chunk_size);
+    *bytes_read += chunk_size;
+  }
+  size_t dummy;
+  *is_last = (in->Read(0, &dummy) == NULL);
+  return true;
+}
+
+double WallSeconds(void) {
+  return std::chrono::duration<double>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+double ThreadCpuSeconds(void) {
+#if defined(CLOCK_THREAD_CPUTIME_ID)
+  timespec t;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t) == 0) {
+    return static_cast<double>(t.tv_sec) +
+        1e-9 * static_cast<double>(t.tv_nsec);
+  }
+#endif
+  return 0.0;
+}
+
+class BatchInputTask;
+
+// Compresses one block of a large input of BrotliCompressBatch.
+class BatchBlockTask : public CompressBlockTask {
+ public:
+  BatchBlockTask(const BrotliParams& params,
+                 uint32_t input_block_size,
+                 const uint8_t* input_block,
+                 uint32_t prefix_size,
+                 const uint8_t* prefix,
+                 size_t tail_size,
+                 bool is_first,
+                 bool is_last,
+                 HashersCache* hashers_cache,
+                 BatchInputTask* input)
+      : CompressBlockTask(params, input_block_size, input_block,
+                          prefix_size, prefix, tail_size, is_first, is_last,
+                          hashers_cache),
+        input_(input),
+        cpu_seconds_(0.0) {}
+
+  void Run(void);
+
+  double cpu_seconds(void) const { return cpu_seconds_; }
+
+ private:
+  BatchInputTask* input_;
+  double cpu_seconds_;
+};
+
+// Compresses one input of BrotliCompressBatch. A small input is compressed
+// right away, a large one is split into blocks that are scheduled on the same
+// pool, where other threads can steal them. Finish() puts the output
+// together after the pool is done.
+class BatchInputTask : public ThreadPoolTask {
+ public:
+  // Small inputs are compressed with params, the blocks of large ones with
+  // block_params, which must have been sanitized with SanitizeParams.
+  BatchInputTask(const BrotliParams& params,
+                 const BrotliParams& block_params,
+                 BrotliBatchItem* item,
+                 HashersCache* hashers_cache,
+                 WorkStealingPool* pool)
+      : params_(params),
+        block_params_(block_params),
+        item_(item),
+        hashers_cache_(hashers_cache),
+        pool_(pool),
+        num_running_blocks_(0),
+        start_time_(0.0),
+        end_time_(0.0) {}
+
+  ~BatchInputTask(void) {
+    for (size_t i = 0; i < blocks_.size(); ++i) {
+      delete blocks_[i];
+    }
+  }
+
+  void Run(void) {
+    start_time_ = WallSeconds();
+    const double cpu_start = ThreadCpuSeconds();
+    const size_t input_size = item_->input_size;
+    const uint8_t* input_buffer = item_->input_buffer;
+    const size_t max_input_block_size = 1 << block_params_.lgblock;
+    if (input_size <= max_input_block_size) {
+      size_t out_size = input_size + (input_size >> 3) + 1024;
+      item_->output.resize(out_size);
+      item_->ok = BrotliCompressBuffer(params_, input_size, input_buffer,
+                                       &out_size, &item_->output[0]);
+      item_->output.resize(item_->ok ? out_size : 0);
+      item_->cpu_seconds = ThreadCpuSeconds() - cpu_start;
+      end_time_ = WallSeconds();
+      return;
+    }
+    const size_t max_prefix_size = 1u << block_params_.lgwin;
+    for (size_t pos = 0; pos < input_size; ) {
+      uint32_t input_block_size = static_cast<uint32_t>(
+          std::min(max_input_block_size, input_size - pos));
+      uint32_t prefix_size =
+          static_cast<uint32_t>(std::min(max_prefix_size, pos));
+      blocks_.push_back(new BatchBlockTask(
+          block_params_,
+          input_block_size,
+          &input_buffer[pos],
+          prefix_size,
+          &input_buffer[pos - prefix_size],
+          input_size - pos - input_block_size,
+          pos == 0,
+          pos + input_block_size == input_size,
+          hashers_cache_,
+          this));
+      pos += input_block_size;
+    }
+    num_running_blocks_ = blocks_.size();
+    item_->cpu_seconds = ThreadCpuSeconds() - cpu_start;
+    for (size_t i = 0; i < blocks_.size(); ++i) {
+      pool_->Schedule(blocks_[i]);
+    }
+  }
+
+  // Called by every block when it is done.
+  void BlockDone(void) {
+    if (--num_running_blocks_ == 0) {
+      end_time_ = WallSeconds();
+    }
+  }
+
+  // Puts together the output of a split input and sets the statistics of the
+  // item. Must be called after all blocks are done.
+  void Finish(void) {
+    item_->compression_seconds = end_time_ - start_time_;
+    if (blocks_.empty()) {
+      return;
+    }
+    size_t out_size = 0;
+    item_->ok = 1;
+    for (size_t i = 0; i < blocks_.size(); ++i) {
+      out_size += blocks_[i]->output().size();
+      item_->cpu_seconds += blocks_[i]->cpu_seconds();
+      if (!blocks_[i]->ok()) {
+        item_->ok = 0;
+      }
+    }
+    item_->output.clear();
+    if (item_->ok) {
+      item_->output.reserve(out_size);
+      for (size_t i = 0; i < blocks_.size(); ++i) {
+        const std::vector<uint8_t>& out = blocks_[i]->output();
+        item_->output.insert(item_->output.end(), out.begin(), out.end());
+      }
+    }
+    for (size_t i = 0; i < blocks_.size(); ++i) {
+      delete blocks_[i];
+    }
+    blocks_.clear();
+  }
+
+ private:
+  const BrotliParams& params_;
+  const BrotliParams& block_params_;
+  BrotliBatchItem* item_;
+  HashersCache* hashers_cache_;
+  WorkStealingPool* pool_;
+  std::vector<BatchBlockTask*> blocks_;
+  std::atomic<size_t> num_running_blocks_;
+  double start_time_;
+  double end_time_;
+};
+
+void BatchBlockTask::Run(void) {
+  const double cpu_start = ThreadCpuSeconds();
+  CompressBlockTask::Run();
+  cpu_seconds_ = ThreadCpuSeconds() - cpu_start;
+  input_->BlockDone();
+}
+
+// Orders the inputs of BrotliCompressBatch by increasing size.
+class SmallerInputFirst {
+ public:
+  explicit SmallerInputFirst(const std::vector<BrotliBatchItem>* items)
+      : items_(items) {}
+
+  bool operator()(size_t a, size_t b) const {
+    return (*items_)[a].input_size < (*items_)[b].input_size;
+  }
+
+ private:
+  const std::vector<BrotliBatchItem>* items_;
+};
+
 }  // namespace
 
 int BrotliCompressBufferParallel(BrotliParams params,
@@ -207,6 +579,17 @@ int BrotliCompressBufferParallel(BrotliParams params,
                                  const uint8_t* input_buffer,
                                  size_t* encoded_size,
                                  uint8_t* encoded_buffer) {
+  return BrotliCompressBufferParallel(params, input_size, input_buffer,
+                                      encoded_size, encoded_buffer,
+                                      DefaultNumThreads());
+}
+
+int BrotliCompressBufferParallel(BrotliParams params,
+                                 size_t input_size,
+                                 const uint8_t* input_buffer,
+                                 size_t* encoded_size,
+                                 uint8_t* encoded_buffer,
+                                 int num_threads) {
   if (*encoded_size == 0) {
     // Output buffer needs at least one byte.
     return 0;
@@ -216,64 +599,208 @@ int BrotliCompressBufferParallel(BrotliParams params,
     return 1;
   }
 
-  // Sanitize params.
-  if (params.lgwin < kMinWindowBits) {
-    params.lgwin = kMinWindowBits;
-  } else if (params.lgwin > kMaxWindowBits) {
-    params.lgwin = kMaxWindowBits;
-  }
-  if (params.lgblock == 0) {
-    params.lgblock = 16;
-    if (params.quality >= 9 && params.lgwin > params.lgblock) {
-      params.lgblock = std::min(21, params.lgwin);
-    }
-  } else if (params.lgblock < kMinInputBlockBits) {
-    params.lgblock = kMinInputBlockBits;
-  } else if (params.lgblock > kMaxInputBlockBits) {
-    params.lgblock = kMaxInputBlockBits;
-  }
+  SanitizeParams(&params);
   size_t max_input_block_size = 1 << params.lgblock;
   size_t max_prefix_size = 1u << params.lgwin;
 
-  std::vector<std::vector<uint8_t> > compressed_pieces;
-
-  // Compress block-by-block independently.
+  // Split the input into blocks.
+  HashersCache hashers_cache(ParallelHashType(params),
+                             params.prefetch_hash_buckets,
+                             params.use_huge_pages);
+  std::vector<CompressBlockTask*> tasks;
   for (size_t pos = 0; pos < input_size; ) {
     uint32_t input_block_size =
         static_cast<uint32_t>(std::min(max_input_block_size, input_size - pos));
     uint32_t prefix_size =
         static_cast<uint32_t>(std::min(max_prefix_size, pos));
-    size_t out_size = input_block_size + (input_block_size >> 3) + 1024;
-    std::vector<uint8_t> out(out_size);
-    if (!WriteMetaBlockParallel(params,
-                                input_block_size,
-                                &input_buffer[pos],
-                                prefix_size,
-                                &input_buffer[pos - prefix_size],
-                                pos == 0,
-                                pos + input_block_size == input_size,
-                                &out_size,
-                                &out[0])) {
-      return false;
-    }
-    out.resize(out_size);
-    compressed_pieces.push_back(out);
+    tasks.push_back(new CompressBlockTask(params,
+                                          input_block_size,
+                                          &input_buffer[pos],
+                                          prefix_size,
+                                          &input_buffer[pos - prefix_size],
+                                          input_size - pos - input_block_size,
+                                          pos == 0,
+                                          pos + input_block_size == input_size,
+                                          &hashers_cache));
     pos += input_block_size;
   }
 
+  // Compress block-by-block independently. There is no point in starting
+  // more threads than there are blocks.
+  {
+    ThreadPool pool(static_cast<int>(std::min(
+        tasks.size(), static_cast<size_t>(std::max(1, num_threads)))));
+    RunTasks(tasks, &pool);
+  }
+
   // Piece together the output.
+  bool ok = true;
   size_t out_pos = 0;
-  for (size_t i = 0; i < compressed_pieces.size(); ++i) {
-    const std::vector<uint8_t>& out = compressed_pieces[i];
-    if (out_pos + out.size() > *encoded_size) {
-      return false;
+  for (size_t i = 0; i < tasks.size(); ++i) {
+    const std::vector<uint8_t>& out = tasks[i]->output();
+    if (!tasks[i]->ok() || out_pos + out.size() > *encoded_size) {
+      ok = false;
+      break;
     }
     memcpy(&encoded_buffer[out_pos], &out[0], out.size());
     out_pos += out.size();
   }
+  for (size_t i = 0; i < tasks.size(); ++i) {
+    delete tasks[i];
+  }
+  if (!ok) {
+    return false;
+  }
   *encoded_size = out_pos;
 
   return true;
 }
 
+int BrotliCompressParallel(BrotliParams params,
+                           BrotliIn* in, BrotliOut* out,
+                           int num_threads) {
+  SanitizeParams(&params);
+  num_threads = std::max(1, num_threads);
+  const size_t max_input_block_size = 1 << params.lgblock;
+  const size_t max_prefix_size = 1u << params.lgwin;
+
+  // The window is kept at the beginning of the buffer, followed by the input
+  // blocks of the current batch, one for each thread, and the slack. The
+  // slack holds the first bytes of the next batch, or zeros after the end of
+  // the input, so that every block can be compressed in place.
+  std::vector<uint8_t> buffer(
+      max_prefix_size + num_threads * max_input_block_size + kInputSlackBytes);
+  ThreadPool pool(num_threads);
+  HashersCache hashers_cache(ParallelHashType(params),
+                             params.prefetch_hash_buckets,
+                             params.use_huge_pages);
+  size_t prefix_size = 0;
+  // Number of input bytes of the next batch that were already read into the
+  // slack after the current batch.
+  size_t lookahead_size = 0;
+  bool is_first = true;
+  bool is_last = false;
+  while (!is_last || lookahead_size > 0) {
+    // Read the next batch of input blocks.
+    std::vector<CompressBlockTask*> tasks;
+    size_t pos = prefix_size;
+    bool read_ok = true;
+    while (tasks.size() < static_cast<size_t>(num_threads)) {
+      size_t input_block_size = lookahead_size;
+      lookahead_size = 0;
+      if (!is_last) {
+        size_t bytes_read = 0;
+        read_ok = ReadInputBlock(in, max_input_block_size - input_block_size,
+                                 &buffer[pos + input_block_size],
+                                 &bytes_read, &is_last);
+        input_block_size += bytes_read;
+      }
+      if (!read_ok || input_block_size == 0) {
+        break;
+      }
+      const size_t block_prefix_size = std::min(max_prefix_size, pos);
+      tasks.push_back(new CompressBlockTask(
+          params,
+          static_cast<uint32_t>(input_block_size),
+          &buffer[pos],
+          static_cast<uint32_t>(block_prefix_size),
+          &buffer[pos - block_prefix_size],
+          kInputSlackBytes,
+          is_first && tasks.empty(),
+          is_last,
+          &hashers_cache));
+      pos += input_block_size;
+      if (is_last) {
+        break;
+      }
+    }
+    if (read_ok && !is_last) {
+      // The last block of the batch sees the beginning of the next batch,
+      // just like in BrotliCompressBufferParallel.
+      read_ok = ReadInputBlock(in, kInputSlackBytes, &buffer[pos],
+                               &lookahead_size, &is_last);
+    }
+    memset(&buffer[pos + lookahead_size], 0, kInputSlackBytes - lookahead_size);
+    if (tasks.empty()) {
+      if (!read_ok) {
+        return false;
+      }
+      if (is_first) {
+        // Empty input.
+        const uint8_t empty_stream = 6;
+        return out->Write(&empty_stream, 1);
+      }
+      // The end of the input was only detected after the previous batch was
+      // written as non-last, so we close the stream with an empty last
+      // meta-block.
+      const uint8_t empty_last_metablock = 3;
+      return out->Write(&empty_last_metablock, 1);
+    }
+
+    RunTasks(tasks, &pool);
+
+    // Write the compressed blocks of this batch in order.
+    bool ok = read_ok;
+    for (size_t i = 0; i < tasks.size(); ++i) {
+      const std::vector<uint8_t>& block_out = tasks[i]->output();
+      if (ok && (!tasks[i]->ok() ||
+                 !out->Write(&block_out[0], block_out.size()))) {
+        ok = false;
+      }
+      delete tasks[i];
+    }
+    if (!ok) {
+      return false;
+    }
+    is_first = false;
+
+    // Keep the last window of the input and the lookahead for the next batch.
+    const size_t new_prefix_size = std::min(max_prefix_size, pos);
+    memmove(&buffer[0], &buffer[pos - new_prefix_size],
+            new_prefix_size + lookahead_size);
+    prefix_size = new_prefix_size;
+  }
+  return true;
+}
+
+int BrotliCompressBatch(BrotliParams params,
+                        std::vector<BrotliBatchItem>* items,
+                        int num_threads) {
+  BrotliParams block_params = params;
+  SanitizeParams(&block_params);
+  std::vector<size_t> order(items->size());
+  for (size_t i = 0; i < order.size(); ++i) {
+    order[i] = i;
+  }
+  // The workers take the newest task of their own queue first, so scheduling
+  // the smallest inputs first makes every worker start with the largest of
+  // its inputs, while the small ones at the other end are left for stealing.
+  std::stable_sort(order.begin(), order.end(), SmallerInputFirst(items));
+
+  HashersCache hashers_cache(ParallelHashType(block_params),
+                             block_params.prefetch_hash_buckets,
+                             block_params.use_huge_pages);
+  std::vector<BatchInputTask*> tasks(items->size());
+  {
+    WorkStealingPool pool(std::max(1, num_threads));
+    for (size_t i = 0; i < order.size(); ++i) {
+      tasks[order[i]] = new BatchInputTask(params, block_params,
+                                           &(*items)[order[i]],
+                                           &hashers_cache, &pool);
+      pool.Schedule(tasks[order[i]]);
+    }
+    pool.Wait();
+  }
+
+  int ok = 1;
+  for (size_t i = 0; i < tasks.size(); ++i) {
+    tasks[i]->Finish();
+    if (!(*items)[i].ok) {
+      ok = 0;
+    }
+    delete tasks[i];
+  }
+  return ok;
+}
+
 }  // namespace brotli
@@ -12,17 +12,78 @@
 #define BROTLI_ENC_ENCODE_PARALLEL_H_
 
 
+#include <vector>
+
 #include "./encode.h"
 #include "./types.h"
 
 namespace brotli {
 
+// Compresses the data in input_buffer into encoded_buffer, and sets
+// *encoded_size to the compressed length. The input is split into blocks of
+// at most 1 << params.lgblock bytes, which are compressed independently on
+// num_threads worker threads. The output does not depend on num_threads.
+// Returns 0 if there was an error and 1 otherwise.
+int BrotliCompressBufferParallel(BrotliParams params,
+                                 size_t input_size,
+                                 const uint8_t* input_buffer,
+                                 size_t* encoded_size,
+                                 uint8_t* encoded_buffer,
+                                 int num_threads);
+
+// Same as above, but uses one worker thread per hardware thread.
 int BrotliCompressBufferParallel(BrotliParams params,
                                  size_t input_size,
                                  const uint8_t* input_buffer,
                                  size_t* encoded_size,
                                  uint8_t* encoded_buffer);
 
+// Same as above, but reads the input from "in" and writes the compressed
+// stream to "out". The input is read in batches of num_threads blocks, which
+// are compressed concurrently and written to "out" in order before the next
+// batch is read, so at most the window plus num_threads input blocks and
+// their compressed forms are kept in memory. The output is identical to that
+// of BrotliCompressBufferParallel with the same params.
+// Returns 0 if there was an error and 1 otherwise.
+int BrotliCompressParallel(BrotliParams params,
+                           BrotliIn* in, BrotliOut* out,
+                           int num_threads);
+
+// One input of BrotliCompressBatch.
+struct BrotliBatchItem {
+  BrotliBatchItem(void)
+      : input_size(0),
+        input_buffer(NULL),
+        ok(0),
+        compression_seconds(0.0),
+        cpu_seconds(0.0) {}
+
+  size_t input_size;
+  const uint8_t* input_buffer;
+
+  // The rest is set by BrotliCompressBatch.
+  std::vector<uint8_t> output;
+  // 1 if output holds the compressed stream, 0 if there was an error.
+  int ok;
+  // Wall-clock time from the start of the first to the end of the last
+  // compression task of this input.
+  double compression_seconds;
+  // Thread CPU time used by the compression tasks of this input.
+  double cpu_seconds;
+};
+
+// Compresses every input of *items into its own brotli stream on num_threads
+// worker threads. Inputs of at most 1 << params.lgblock bytes are compressed
+// as a whole, like with BrotliCompressBuffer, larger ones are split into
+// blocks, like with BrotliCompressBufferParallel, and the output is the same
+// as that of the respective function. Whole inputs and blocks are scheduled
+// on a work-stealing pool, largest inputs first, so that idle threads help
+// with the blocks of a large input instead of waiting for it.
+// Returns 0 if any of the inputs failed and 1 otherwise.
+int BrotliCompressBatch(BrotliParams params,
+                        std::vector<BrotliBatchItem>* items,
+                        int num_threads);
+
 }  // namespace brotli
 
 #endif  // BROTLI_ENC_ENCODE_PARALLEL_H_
@@ -0,0 +1,89 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+   Distributed under MIT license.
+   See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+*/
+
+// SIMD versions of FindMatchLengthWithLimit for long matches.
+
+#include "./find_match_length.h"
+
+#ifdef BROTLI_FIND_MATCH_LENGTH_SIMD
+#include <immintrin.h>
+#endif
+
+namespace brotli {
+
+#ifdef BROTLI_FIND_MATCH_LENGTH_SIMD
+
+namespace {
+
+typedef size_t (*FindMatchLengthFunc)(const uint8_t* s1,
+                                      const uint8_t* s2,
+                                      size_t limit);
+
+// The loops only load whole vectors that are within the limit, the rest is
+// left to the scalar version.
+
+__attribute__((target("avx2")))
+size_t FindMatchLengthWithLimitAVX2(const uint8_t* s1,
+                                    const uint8_t* s2,
+                                    size_t limit) {
+  size_t matched = 0;
+  while (limit - matched >= 32) {
+    const __m256i a =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s1 + matched));
+    const __m256i b =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s2 + matched));
+    const uint32_t mismatch = ~static_cast<uint32_t>(
+        _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b)));
+    if (mismatch != 0) {
+      return matched + static_cast<size_t>(__builtin_ctz(mismatch));
+    }
+    matched += 32;
+  }
+  return matched + FindMatchLengthWithLimit(s1 + matched, s2 + matched,
+                                            limit - matched);
+}
+
+size_t FindMatchLengthWithLimitSSE2(const uint8_t* s1,
+                                    const uint8_t* s2,
+                                    size_t limit) {
+  size_t matched = 0;
+  while (limit - matched >= 16) {
+    const __m128i a =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(s1 + matched));
+    const __m128i b =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(s2 + matched));
+    const uint32_t mismatch = static_cast<uint32_t>(
+        _mm_movemask_epi8(_mm_cmpeq_epi8(a, b))) ^ 0xffffu;
+    if (mismatch != 0) {
+      return matched + static_cast<size_t>(__builtin_ctz(mismatch));
+    }
+    matched += 16;
+  }
+  return matched + FindMatchLengthWithLimit(s1 + matched, s2 + matched,
+                                            limit - matched);
+}
+
+// SSE2 is part of x86-64, so only AVX2 has to be checked with CPUID.
+FindMatchLengthFunc ChooseFindMatchLength(void) {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return FindMatchLengthWithLimitAVX2;
+  }
+  return FindMatchLengthWithLimitSSE2;
+}
+
+}  // namespace
+
+size_t FindMatchLengthWithLimitSimd(const uint8_t* s1,
+                                    const uint8_t* s2,
+                                    size_t limit) {
+  static const FindMatchLengthFunc find_match_length = ChooseFindMatchLength();
+  return find_match_length(s1, s2, limit);
+}
+
+#endif  // BROTLI_FIND_MATCH_LENGTH_SIMD
+
+}  // namespace brotli
@@ -18,6 +18,21 @@ namespace brotli {
 // Separate implementation for little-endian 64-bit targets, for speed.
 #if defined(__GNUC__) && defined(_LP64) && defined(IS_LITTLE_ENDIAN)
 
+#if defined(__x86_64__)
+#define BROTLI_FIND_MATCH_LENGTH_SIMD
+
+// Once the first kMinMatchLengthForSimd bytes matched, the rest of the match
+// is compared by FindMatchLengthWithLimitSimd, provided that at least
+// kMinMatchLengthForSimd more bytes are allowed.
+static const size_t kMinMatchLengthForSimd = 16;
+
+// Same as FindMatchLengthWithLimit, but compares 32 bytes at a time with
+// AVX2 if the CPU supports it, and 16 bytes at a time with SSE2 otherwise.
+size_t FindMatchLengthWithLimitSimd(const uint8_t* s1,
+                                    const uint8_t* s2,
+                                    size_t limit);
+#endif
+
 static inline size_t FindMatchLengthWithLimit(const uint8_t* s1,
                                               const uint8_t* s2,
                                               size_t limit) {
@@ -28,6 +43,13 @@ static inline size_t FindMatchLengthWithLimit(const uint8_t* s1,
                       BROTLI_UNALIGNED_LOAD64(s1 + matched))) {
       s2 += 8;
       matched += 8;
+#ifdef BROTLI_FIND_MATCH_LENGTH_SIMD
+      if (matched == kMinMatchLengthForSimd &&
+          limit >= 2 * kMinMatchLengthForSimd) {
+        return matched + FindMatchLengthWithLimitSimd(s1 + matched, s2,
+                                                      limit - matched);
+      }
+#endif
     } else {
       uint64_t x =
           BROTLI_UNALIGNED_LOAD64(s2) ^ BROTLI_UNALIGNED_LOAD64(s1 + matched);
@@ -14,15 +14,23 @@
 #include <algorithm>
 #include <cstring>
 #include <limits>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "./dictionary_hash.h"
 #include "./fast_log.h"
 #include "./find_match_length.h"
+#include "./large_table.h"
 #include "./port.h"
 #include "./prefix.h"
 #include "./static_dict.h"
 #include "./transform.h"
 #include "./types.h"
+#include "./zopfli_cost_model.h"
+#include "./zopfli_node.h"
 
 namespace brotli {
 
@@ -36,6 +44,37 @@ static const int kDistanceCacheOffset[] = {
   0, 0, 0, 0, -1, 1, -2, 2, -3, 3, -1, 1, -2, 2, -3, 3
 };
 
+// The candidates of the last distances 0 and 1 with offsets -3 to 3 lie in a
+// window of 7 positions, which LastDistanceWindowMask checks at once.
+static const size_t kLastDistanceWindowSize = 7;
+static const size_t kMinLastDistanceForWindow = 11;
+
+// Returns a mask with bit k set if the candidate at window[k] may be used as
+// a match of s, i.e. if its first 3 bytes, or for the middle candidate with
+// offset 0 its first 2 bytes, are the same as those of s. Reads 16 bytes
+// starting at window.
+static inline uint32_t LastDistanceWindowMask(const uint8_t* window,
+                                              const uint8_t* s) {
+#if defined(__SSE2__)
+  const __m128i w =
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(window));
+  const __m128i eq01 = _mm_and_si128(
+      _mm_cmpeq_epi8(w, _mm_set1_epi8(static_cast<char>(s[0]))),
+      _mm_cmpeq_epi8(_mm_srli_si128(w, 1),
+                     _mm_set1_epi8(static_cast<char>(s[1]))));
+  const __m128i eq012 = _mm_and_si128(
+      eq01, _mm_cmpeq_epi8(_mm_srli_si128(w, 2),
+                           _mm_set1_epi8(static_cast<char>(s[2]))));
+  const uint32_t mask2 = static_cast<uint32_t>(_mm_movemask_epi8(eq01));
+  const uint32_t mask3 = static_cast<uint32_t>(_mm_movemask_epi8(eq012));
+  return (mask3 | (mask2 & 8)) & ((1u << kLastDistanceWindowSize) - 1);
+#else
+  (void)window;
+  (void)s;
+  return (1u << kLastDistanceWindowSize) - 1;
+#endif
+}
+
 static const uint32_t kCutoffTransformsCount = 10;
 static const uint8_t kCutoffTransforms[] = {
   0, 12, 27, 23, 42, 63, 56, 48, 59, 64
@@ -114,6 +153,81 @@ struct BackwardMatch {
   uint32_t length_and_code;
 };
 
+// Counters of the match search of a hasher since its last Reset(), see
+// BrotliCompressor::stats().
+struct HasherStats {
+  HasherStats(void)
+      : num_lookups(0), num_comparisons(0),
+        num_dict_lookups(0), num_dict_matches(0) {}
+
+  // Positions whose matches were searched.
+  size_t num_lookups;
+  // Earlier positions whose data was compared with the data of a position.
+  size_t num_comparisons;
+  // Lookups of the static dictionary, and the ones that found a word that
+  // was a better match than any found before.
+  size_t num_dict_lookups;
+  size_t num_dict_matches;
+};
+
+// Returns true if the static dictionary has a word for the given key of
+// kStaticDictionaryHash. The bit filter is checked first, so that keys
+// without a word do not touch the much larger hash table.
+inline bool StaticDictionaryHasKey(size_t dict_key) {
+  return (kStaticDictionaryHashFilter[dict_key >> 5] >>
+          (dict_key & 31)) & 1;
+}
+
+// Decides whether looking up the static dictionary is worth it, based on
+// the hit rate of the recent lookups of the stream. The lookups stop while
+// less than one in 128 of them finds a match, but one position in
+// kProbeInterval still does a lookup, so that they can start again when
+// the data turns back to text.
+class StaticDictionaryLookupStats {
+ public:
+  StaticDictionaryLookupStats(void) {
+    Reset();
+  }
+
+  void Reset(void) {
+    num_lookups_ = 0;
+    num_matches_ = 0;
+    num_skipped_ = 0;
+  }
+
+  bool ShouldLookup(void) {
+    if (num_matches_ >= (num_lookups_ >> 7)) {
+      return true;
+    }
+    if (++num_skipped_ < kProbeInterval) {
+      return false;
+    }
+    num_skipped_ = 0;
+    return true;
+  }
+
+  void AddLookup(void) {
+    // Halving both counters keeps their ratio, but lets the recent lookups
+    // weigh more than the old ones.
+    if (++num_lookups_ == kMaxLookups) {
+      num_lookups_ >>= 1;
+      num_matches_ >>= 1;
+    }
+  }
+
+  void AddMatch(void) {
+    ++num_matches_;
+  }
+
+ private:
+  static const size_t kProbeInterval = 64;
+  static const size_t kMaxLookups = 1 << 16;
+
+  size_t num_lookups_;
+  size_t num_matches_;
+  size_t num_skipped_;
+};
+
 // A (forgetful) hash table to the data seen by the compressor, to
 // help create backward references to previous data.
 //
@@ -127,8 +241,8 @@ class HashLongestMatchQuickly {
   }
   void Reset(void) {
     need_init_ = true;
-    num_dict_lookups_ = 0;
-    num_dict_matches_ = 0;
+    dict_stats_.Reset();
+    stats_ = HasherStats();
   }
   void Init(void) {
     if (need_init_) {
@@ -157,6 +271,14 @@ class HashLongestMatchQuickly {
     buckets_[key + off] = ix;
   }
 
+  // Prefetching for a position ahead of the current one, see
+  // CreateBackwardReferences. The bucket sweep range is small enough to be
+  // fetched right away.
+  inline void PrefetchKey(const uint8_t* data) const {
+    BROTLI_PREFETCH(&buckets_[HashBytes(data)]);
+  }
+  inline void PrefetchBucket(const uint8_t*) const {}
+
   // Find a longest backward match of &ring_buffer[cur_ix & ring_buffer_mask]
   // up to the length of max_length and stores the position cur_ix in the
   // hash table.
@@ -185,7 +307,9 @@ class HashLongestMatchQuickly {
     size_t cached_backward = static_cast<size_t>(distance_cache[0]);
     size_t prev_ix = cur_ix - cached_backward;
     bool match_found = false;
+    ++stats_.num_lookups;
     if (prev_ix < cur_ix) {
+      ++stats_.num_comparisons;
       prev_ix &= static_cast<uint32_t>(ring_buffer_mask);
       if (compare_char == ring_buffer[prev_ix + best_len]) {
         size_t len = FindMatchLengthWithLimit(&ring_buffer[prev_ix],
@@ -214,6 +338,7 @@ class HashLongestMatchQuickly {
       buckets_[key] = static_cast<uint32_t>(cur_ix);
       size_t backward = cur_ix - prev_ix;
       prev_ix &= static_cast<uint32_t>(ring_buffer_mask);
+      ++stats_.num_comparisons;
       if (compare_char != ring_buffer[prev_ix + best_len_in]) {
         return false;
       }
@@ -233,6 +358,7 @@ class HashLongestMatchQuickly {
     } else {
       uint32_t *bucket = buckets_ + key;
       prev_ix = *bucket++;
+      stats_.num_comparisons += kBucketSweep;
       for (int i = 0; i < kBucketSweep; ++i, prev_ix = *bucket++) {
         const size_t backward = cur_ix - prev_ix;
         prev_ix &= static_cast<uint32_t>(ring_buffer_mask);
@@ -260,12 +386,12 @@ class HashLongestMatchQuickly {
         }
       }
     }
-    if (kUseDictionary && !match_found &&
-        num_dict_matches_ >= (num_dict_lookups_ >> 7)) {
-      ++num_dict_lookups_;
+    if (kUseDictionary && !match_found && dict_stats_.ShouldLookup()) {
+      dict_stats_.AddLookup();
+      ++stats_.num_dict_lookups;
       const uint32_t dict_key = Hash<14>(&ring_buffer[cur_ix_masked]) << 1;
-      const uint16_t v = kStaticDictionaryHash[dict_key];
-      if (v > 0) {
+      if (StaticDictionaryHasKey(dict_key)) {
+        const uint16_t v = kStaticDictionaryHash[dict_key];
         const uint32_t len = v & 31;
         const uint32_t dist = v >> 5;
         const size_t offset =
@@ -282,7 +408,8 @@ class HashLongestMatchQuickly {
             const size_t backward = max_backward + word_id + 1;
             const double score = BackwardReferenceScore(matchlen, backward);
             if (best_score < score) {
-              ++num_dict_matches_;
+              dict_stats_.AddMatch();
+              ++stats_.num_dict_matches;
               best_score = score;
               best_len = matchlen;
               *best_len_out = best_len;
@@ -316,39 +443,82 @@ class HashLongestMatchQuickly {
 
   enum { kHashMapSize = 4 << kBucketBits };
 
+  const HasherStats& stats(void) const {
+    return stats_;
+  }
+
  private:
   static const uint32_t kBucketSize = 1 << kBucketBits;
   uint32_t buckets_[kBucketSize + kBucketSweep];
   // True if buckets_ array needs to be initialized.
   bool need_init_;
-  size_t num_dict_lookups_;
-  size_t num_dict_matches_;
+  StaticDictionaryLookupStats dict_stats_;
+  HasherStats stats_;
 };
 
 // A (forgetful) hash table to the data seen by the compressor, to
 // help create backward references to previous data.
 //
-// This is a hash map of fixed size (kBucketSize) to a ring buffer of
-// fixed size (kBlockSize). The ring buffer contains the last kBlockSize
-// index positions of the given hash key in the compressed data.
+// This is a hash map of fixed size (1 << kBucketBits, or less for small
+// inputs) to a ring buffer of fixed size (kBlockSize). The ring buffer
+// contains the last kBlockSize index positions of the given hash key in the
+// compressed data.
 template <int kBucketBits,
           int kBlockBits,
           int kNumLastDistancesToCheck>
 class HashLongestMatch {
  public:
-  HashLongestMatch(void) {
+  HashLongestMatch(void) : bucket_bits_(kBucketBits), huge_pages_(true) {
+    Allocate();
+    Reset();
+  }
+
+  // Creates a hasher with 1 << bucket_bits instead of 1 << kBucketBits
+  // buckets, see BucketBitsForInputSize(). If huge_pages is true, large
+  // tables are backed by huge pages, see AllocateLargeTable().
+  HashLongestMatch(int bucket_bits, bool huge_pages)
+      : bucket_bits_(bucket_bits), huge_pages_(huge_pages) {
+    Allocate();
     Reset();
   }
 
+  ~HashLongestMatch(void) {
+    FreeLargeTable(num_, NumSize());
+    FreeLargeTable(buckets_, BucketsSize());
+  }
+
+  // Returns the number of bucket bits for a stream that is known to be at
+  // most input_size bytes long, or kBucketBits if input_size is 0.
+  // Every bucket holds kBlockSize positions, so the full table is up to
+  // 32 MB, and setting it up for a small input takes much longer than
+  // compressing it. With at least as many buckets as positions, the hash
+  // collisions are about as rare as with the full table.
+  static int BucketBitsForInputSize(size_t input_size) {
+    if (input_size == 0) {
+      return kBucketBits;
+    }
+    int bucket_bits = kMinBucketBits;
+    while (bucket_bits < kBucketBits &&
+           (static_cast<size_t>(1) << bucket_bits) < input_size) {
+      ++bucket_bits;
+    }
+    return bucket_bits;
+  }
+
+  int bucket_bits(void) const {
+    return bucket_bits_;
+  }
+
   void Reset(void) {
     need_init_ = true;
-    num_dict_lookups_ = 0;
-    num_dict_matches_ = 0;
+    dict_stats_.Reset();
+    stats_ = HasherStats();
   }
 
   void Init(void) {
     if (need_init_) {
-      memset(&num_[0], 0, sizeof(num_));
+      memset(&num_[0], 0, (static_cast<size_t>(1) << bucket_bits_) *
+             sizeof(num_[0]));
       need_init_ = false;
     }
   }
@@ -366,10 +536,23 @@ class HashLongestMatch {
   inline void Store(const uint8_t *data, const uint32_t ix) {
     const uint32_t key = HashBytes(data);
     const int minor_ix = num_[key] & kBlockMask;
-    buckets_[key][minor_ix] = ix;
+    Bucket(key)[minor_ix] = ix;
     ++num_[key];
   }
 
+  // Prefetching for positions ahead of the current one, see
+  // CreateBackwardReferences. The newest entry of a bucket can only be found
+  // after its entry count is loaded, so PrefetchKey fetches the count and a
+  // later PrefetchBucket for the same data, when the count is expected to be
+  // in the cache, fetches the newest entries.
+  inline void PrefetchKey(const uint8_t* data) const {
+    BROTLI_PREFETCH(&num_[HashBytes(data)]);
+  }
+  inline void PrefetchBucket(const uint8_t* data) const {
+    const uint32_t key = HashBytes(data);
+    BROTLI_PREFETCH(&Bucket(key)[(num_[key] - 1) & kBlockMask]);
+  }
+
   // Find a longest backward match of &data[cur_ix] up to the length of
   // max_length and stores the position cur_ix in the hash table.
   //
@@ -395,7 +578,22 @@ class HashLongestMatch {
     // Don't accept a short copy from far away.
     double best_score = *best_score_out;
     size_t best_len = *best_len_out;
+    size_t num_comparisons = 0;
     *best_len_out = 0;
+    // The candidates around the last two distances are first compared all
+    // at once, and only the ones that can be used are checked one by one.
+    uint32_t window_masks[2] = { ~0u, ~0u };
+    if (kNumLastDistancesToCheck > 4) {
+      for (size_t idx = 0; idx < 2; ++idx) {
+        const size_t distance = static_cast<size_t>(distance_cache[idx]);
+        // The window must lie before the current position, in one piece.
+        if (distance >= kMinLastDistanceForWindow &&
+            cur_ix_masked >= distance + 3) {
+          window_masks[idx] = LastDistanceWindowMask(
+              &data[cur_ix_masked - distance - 3], &data[cur_ix_masked]);
+        }
+      }
+    }
     // Try last distance first.
     for (size_t i = 0; i < kNumLastDistancesToCheck; ++i) {
       const size_t idx = kDistanceCacheIndex[i];
@@ -409,6 +607,11 @@ class HashLongestMatch {
         continue;
       }
       prev_ix &= ring_buffer_mask;
+      ++num_comparisons;
+      if (idx < 2 &&
+          !((window_masks[idx] >> (3 - kDistanceCacheOffset[i])) & 1)) {
+        continue;
+      }
 
       if (cur_ix_masked + best_len > ring_buffer_mask ||
           prev_ix + best_len > ring_buffer_mask ||
@@ -435,7 +638,7 @@ class HashLongestMatch {
       }
     }
     const uint32_t key = HashBytes(&data[cur_ix_masked]);
-    const uint32_t * __restrict const bucket = &buckets_[key][0];
+    const uint32_t * __restrict const bucket = Bucket(key);
     const size_t down = (num_[key] > kBlockSize) ? (num_[key] - kBlockSize) : 0;
     for (size_t i = num_[key]; i > down;) {
       --i;
@@ -445,6 +648,7 @@ class HashLongestMatch {
         break;
       }
       prev_ix &= ring_buffer_mask;
+      ++num_comparisons;
       if (cur_ix_masked + best_len > ring_buffer_mask ||
           prev_ix + best_len > ring_buffer_mask ||
           data[cur_ix_masked + best_len] != data[prev_ix + best_len]) {
@@ -469,14 +673,17 @@ class HashLongestMatch {
         }
       }
     }
-    buckets_[key][num_[key] & kBlockMask] = static_cast<uint32_t>(cur_ix);
+    Bucket(key)[num_[key] & kBlockMask] = static_cast<uint32_t>(cur_ix);
     ++num_[key];
-    if (!match_found && num_dict_matches_ >= (num_dict_lookups_ >> 7)) {
+    ++stats_.num_lookups;
+    stats_.num_comparisons += num_comparisons;
+    if (!match_found && dict_stats_.ShouldLookup()) {
       size_t dict_key = Hash<14>(&data[cur_ix_masked]) << 1;
       for (int k = 0; k < 2; ++k, ++dict_key) {
-        ++num_dict_lookups_;
-        const uint16_t v = kStaticDictionaryHash[dict_key];
-        if (v > 0) {
+        dict_stats_.AddLookup();
+        ++stats_.num_dict_lookups;
+        if (StaticDictionaryHasKey(dict_key)) {
+          const uint16_t v = kStaticDictionaryHash[dict_key];
           const size_t len = v & 31;
           const size_t dist = v >> 5;
           const size_t offset =
@@ -493,7 +700,8 @@ class HashLongestMatch {
               const size_t backward = max_backward + word_id + 1;
               double score = BackwardReferenceScore(matchlen, backward);
               if (best_score < score) {
-                ++num_dict_matches_;
+                dict_stats_.AddMatch();
+                ++stats_.num_dict_matches;
                 best_score = score;
                 best_len = matchlen;
                 *best_len_out = best_len;
@@ -526,6 +734,7 @@ class HashLongestMatch {
     BackwardMatch* const orig_matches = matches;
     const size_t cur_ix_masked = cur_ix & ring_buffer_mask;
     size_t best_len = 1;
+    size_t num_comparisons = 0;
     size_t stop = cur_ix - 64;
     if (cur_ix < 64) { stop = 0; }
     for (size_t i = cur_ix - 1; i > stop && best_len <= 2; --i) {
@@ -535,6 +744,7 @@ class HashLongestMatch {
         break;
       }
       prev_ix &= ring_buffer_mask;
+      ++num_comparisons;
       if (data[cur_ix_masked] != data[prev_ix] ||
           data[cur_ix_masked + 1] != data[prev_ix + 1]) {
         continue;
@@ -548,7 +758,7 @@ class HashLongestMatch {
       }
     }
     const uint32_t key = HashBytes(&data[cur_ix_masked]);
-    const uint32_t * __restrict const bucket = &buckets_[key][0];
+    const uint32_t * __restrict const bucket = Bucket(key);
     const size_t down = (num_[key] > kBlockSize) ? (num_[key] - kBlockSize) : 0;
     for (size_t i = num_[key]; i > down;) {
       --i;
@@ -558,6 +768,7 @@ class HashLongestMatch {
         break;
       }
       prev_ix &= ring_buffer_mask;
+      ++num_comparisons;
       if (cur_ix_masked + best_len > ring_buffer_mask ||
           prev_ix + best_len > ring_buffer_mask ||
           data[cur_ix_masked + best_len] != data[prev_ix + best_len]) {
@@ -571,15 +782,19 @@ class HashLongestMatch {
         *matches++ = BackwardMatch(backward, len);
       }
     }
-    buckets_[key][num_[key] & kBlockMask] = static_cast<uint32_t>(cur_ix);
+    Bucket(key)[num_[key] & kBlockMask] = static_cast<uint32_t>(cur_ix);
     ++num_[key];
+    ++stats_.num_lookups;
+    stats_.num_comparisons += num_comparisons;
     uint32_t dict_matches[kMaxDictionaryMatchLen + 1];
     for (size_t i = 0; i <= kMaxDictionaryMatchLen; ++i) {
       dict_matches[i] = kInvalidMatch;
     }
     size_t minlen = std::max<size_t>(4, best_len + 1);
+    ++stats_.num_dict_lookups;
     if (FindAllStaticDictionaryMatches(&data[cur_ix_masked], minlen, max_length,
                                        &dict_matches[0])) {
+      ++stats_.num_dict_matches;
       size_t maxlen = std::min<size_t>(kMaxDictionaryMatchLen, max_length);
       for (size_t l = minlen; l <= maxlen; ++l) {
         uint32_t dict_id = dict_matches[l];
@@ -598,20 +813,49 @@ class HashLongestMatch {
   // HashBytes is the function that chooses the bucket to place
   // the address in. The HashLongestMatch and HashLongestMatchQuickly
   // classes have separate, different implementations of hashing.
-  static uint32_t HashBytes(const uint8_t *data) {
+  uint32_t HashBytes(const uint8_t *data) const {
     uint32_t h = BROTLI_UNALIGNED_LOAD32(data) * kHashMul32;
     // The higher bits contain more mixture from the multiplication,
     // so we take our results from there.
-    return h >> (32 - kBucketBits);
+    return h >> (32 - bucket_bits_);
   }
 
   enum { kHashMapSize = 2 << kBucketBits };
 
   static const size_t kMaxNumMatches = 64 + (1 << kBlockBits);
 
+  const HasherStats& stats(void) const {
+    return stats_;
+  }
+
  private:
-  // Number of hash buckets.
-  static const uint32_t kBucketSize = 1 << kBucketBits;
+  HashLongestMatch(const HashLongestMatch&);
+  HashLongestMatch& operator=(const HashLongestMatch&);
+
+  size_t NumSize(void) const {
+    return sizeof(num_[0]) << bucket_bits_;
+  }
+
+  size_t BucketsSize(void) const {
+    return sizeof(buckets_[0]) << (bucket_bits_ + kBlockBits);
+  }
+
+  void Allocate(void) {
+    num_ = static_cast<uint16_t*>(AllocateLargeTable(NumSize(), huge_pages_));
+    buckets_ = static_cast<uint32_t*>(
+        AllocateLargeTable(BucketsSize(), huge_pages_));
+  }
+
+  uint32_t* Bucket(const uint32_t key) {
+    return &buckets_[static_cast<size_t>(key) << kBlockBits];
+  }
+
+  const uint32_t* Bucket(const uint32_t key) const {
+    return &buckets_[static_cast<size_t>(key) << kBlockBits];
+  }
+
+  // Smallest number of bucket bits used for small inputs.
+  static const int kMinBucketBits = 8;
 
   // Only kBlockSize newest backward references are kept,
   // and the older are forgotten.
@@ -620,17 +864,23 @@ class HashLongestMatch {
   // Mask for accessing entries in a block (in a ringbuffer manner).
   static const uint32_t kBlockMask = (1 << kBlockBits) - 1;
 
+  // Base 2 logarithm of the number of buckets, at most kBucketBits.
+  const int bucket_bits_;
+
+  const bool huge_pages_;
+
   // Number of entries in a particular bucket.
-  uint16_t num_[kBucketSize];
+  uint16_t* num_;
 
-  // Buckets containing kBlockSize of backward references.
-  uint32_t buckets_[kBucketSize][kBlockSize];
+  // Buckets containing kBlockSize of backward references, the bucket of
+  // key starts at buckets_[key << kBlockBits].
+  uint32_t* buckets_;
 
   // True if num_ array needs to be initialized.
   bool need_init_;
 
-  size_t num_dict_lookups_;
-  size_t num_dict_matches_;
+  StaticDictionaryLookupStats dict_stats_;
+  HasherStats stats_;
 };
 
 // A (forgetful) hash table where each hash bucket contains a binary tree of
@@ -641,18 +891,30 @@ class HashLongestMatch {
 // starting positions.
 class HashToBinaryTree {
  public:
-  HashToBinaryTree() : forest_(NULL) {
+  HashToBinaryTree() : forest_(NULL), num_nodes_(0), num_used_nodes_(0),
+                       huge_pages_(true) {
+    Reset();
+  }
+
+  // If huge_pages is true, a large forest is backed by huge pages, see
+  // AllocateLargeTable().
+  explicit HashToBinaryTree(bool huge_pages)
+      : forest_(NULL), num_nodes_(0), num_used_nodes_(0),
+        huge_pages_(huge_pages) {
     Reset();
   }
 
   ~HashToBinaryTree() {
-    delete[] forest_;
+    FreeLargeTable(forest_, ForestSize(num_nodes_));
   }
 
   void Reset() {
     need_init_ = true;
+    stats_ = HasherStats();
   }
 
+  // Must be called before the positions of each new block are stored, with
+  // the position and the size of the block.
   void Init(int lgwin, size_t position, size_t bytes, bool is_last) {
     if (need_init_) {
       window_mask_ = (1u << lgwin) - 1u;
@@ -660,10 +922,34 @@ class HashToBinaryTree {
       for (uint32_t i = 0; i < kBucketSize; i++) {
         buckets_[i] = invalid_pos_;
       }
-      size_t num_nodes = (position == 0 && is_last) ? bytes : window_mask_ + 1;
-      forest_ = new uint32_t[2 * num_nodes];
+      num_used_nodes_ = 0;
       need_init_ = false;
     }
+    // The nodes are indexed by the position modulo the window size, so until
+    // the stream is longer than the window, only the nodes up to the end of
+    // the current block are used, and the forest grows with the input.
+    const size_t num_nodes =
+        std::min<size_t>(position + bytes, window_mask_ + 1);
+    if (num_nodes > num_nodes_) {
+      // Grow geometrically so that the copying takes linear time in total,
+      // but no further than needed if there are no more blocks.
+      size_t new_num_nodes = num_nodes;
+      if (!is_last) {
+        new_num_nodes = std::min<size_t>(std::max(num_nodes, 2 * num_nodes_),
+                                         window_mask_ + 1);
+      }
+      uint32_t* new_forest = static_cast<uint32_t*>(
+          AllocateLargeTable(ForestSize(new_num_nodes), huge_pages_));
+      // After a Reset(), the forest of the previous stream is reused, its
+      // contents are never read before they are written.
+      if (num_used_nodes_ > 0) {
+        memcpy(new_forest, forest_, ForestSize(num_used_nodes_));
+      }
+      FreeLargeTable(forest_, ForestSize(num_nodes_));
+      forest_ = new_forest;
+      num_nodes_ = new_num_nodes;
+    }
+    num_used_nodes_ = std::max(num_used_nodes_, num_nodes);
   }
 
   // Finds all backward matches of &data[cur_ix & ring_buffer_mask] up to the
@@ -682,6 +968,7 @@ class HashToBinaryTree {
     BackwardMatch* const orig_matches = matches;
     const size_t cur_ix_masked = cur_ix & ring_buffer_mask;
     size_t best_len = 1;
+    size_t num_comparisons = 0;
     size_t stop = cur_ix - 64;
     if (cur_ix < 64) { stop = 0; }
     for (size_t i = cur_ix - 1; i > stop && best_len <= 2; --i) {
@@ -691,6 +978,7 @@ class HashToBinaryTree {
         break;
       }
       prev_ix &= ring_buffer_mask;
+      ++num_comparisons;
       if (data[cur_ix_masked] != data[prev_ix] ||
           data[cur_ix_masked + 1] != data[prev_ix + 1]) {
         continue;
@@ -703,6 +991,8 @@ class HashToBinaryTree {
         *matches++ = BackwardMatch(backward, len);
       }
     }
+    ++stats_.num_lookups;
+    stats_.num_comparisons += num_comparisons;
     if (best_len < max_length) {
       matches = StoreAndFindMatches(data, cur_ix, ring_buffer_mask,
                                     max_length, &best_len, matches);
@@ -712,8 +1002,10 @@ class HashToBinaryTree {
       dict_matches[i] = kInvalidMatch;
     }
     size_t minlen = std::max<size_t>(4, best_len + 1);
+    ++stats_.num_dict_lookups;
     if (FindAllStaticDictionaryMatches(&data[cur_ix_masked], minlen, max_length,
                                        &dict_matches[0])) {
+      ++stats_.num_dict_matches;
       size_t maxlen = std::min<size_t>(kMaxDictionaryMatchLen, max_length);
       for (size_t l = minlen; l <= maxlen; ++l) {
         uint32_t dict_id = dict_matches[l];
@@ -737,6 +1029,20 @@ class HashToBinaryTree {
                         &best_len, NULL);
   }
 
+  // Prefetching for a position ahead of the current one, see
+  // ZopfliFindAllMatches. PrefetchKey loads the root of the tree of the
+  // position, PrefetchBucket the children and the data of that root.
+  inline void PrefetchKey(const uint8_t* data) const {
+    BROTLI_PREFETCH(&buckets_[HashBytes(data)]);
+  }
+  inline void PrefetchBucket(const uint8_t* data,
+                             const uint8_t* ringbuffer,
+                             const size_t ringbuffer_mask) const {
+    const size_t root = buckets_[HashBytes(data)];
+    BROTLI_PREFETCH(&forest_[LeftChildIndex(root)]);
+    BROTLI_PREFETCH(&ringbuffer[root & ringbuffer_mask]);
+  }
+
   void StitchToPreviousBlock(size_t num_bytes,
                              size_t position,
                              const uint8_t* ringbuffer,
@@ -758,6 +1064,11 @@ class HashToBinaryTree {
 
   static const size_t kMaxNumMatches = 64 + kMaxTreeSearchDepth;
 
+  // The comparisons include the ones of the tree walks of Store().
+  const HasherStats& stats(void) const {
+    return stats_;
+  }
+
  private:
   // Stores the hash of the next 4 bytes and in a single tree-traversal, the
   // hash bucket's binary tree is searched for matches and is re-rooted at the
@@ -806,6 +1117,7 @@ class HashToBinaryTree {
         }
         break;
       }
+      ++stats_.num_comparisons;
       const size_t cur_len = std::min(best_len_left, best_len_right);
       const size_t len = cur_len +
           FindMatchLengthWithLimit(&data[cur_ix_masked + cur_len],
@@ -839,15 +1151,22 @@ class HashToBinaryTree {
         node_right = LeftChildIndex(prev_ix);
         prev_ix = forest_[node_right];
       }
+      // Both children of the next node are in the same cache line, load it
+      // while its data is compared.
+      BROTLI_PREFETCH(&forest_[LeftChildIndex(prev_ix)]);
     }
     return matches;
   }
 
-  inline size_t LeftChildIndex(const size_t pos) {
+  static size_t ForestSize(const size_t num_nodes) {
+    return 2 * num_nodes * sizeof(uint32_t);
+  }
+
+  inline size_t LeftChildIndex(const size_t pos) const {
     return 2 * (pos & window_mask_);
   }
 
-  inline size_t RightChildIndex(const size_t pos) {
+  inline size_t RightChildIndex(const size_t pos) const {
     return 2 * (pos & window_mask_) + 1;
   }
 
@@ -875,12 +1194,212 @@ class HashToBinaryTree {
   // forest_[2 * pos] and forest_[2 * pos + 1].
   uint32_t* forest_;
 
+  // Number of nodes allocated in forest_.
+  size_t num_nodes_;
+
+  // Number of nodes of forest_ that may be used by the current stream.
+  size_t num_used_nodes_;
+
+  const bool huge_pages_;
+
   // A position used to mark a non-existent sequence, i.e. a tree is empty if
   // its root is at invalid_pos_ and a node is a leaf if both its children
   // are at invalid_pos_.
   uint32_t invalid_pos_;
 
   bool need_init_;
+
+  HasherStats stats_;
+};
+
+// A sparse index of the data seen by the compressor, to find the repeats of
+// long sections that are too far back to still be in the buckets of the
+// regular hashers.
+//
+// A rolling hash of the kMinLength bytes starting at each position is
+// computed, and only the positions whose hash falls into a 1 in
+// 1 << kSampleBits subset are stored, each in a single table slot. Since
+// the sampling depends only on the data, a repeat of a few hundred bytes or
+// more almost always has a sampled position that was also sampled when the
+// same bytes were seen before. The table has about one slot per sampled
+// position of the window, i.e. it is 1 << kSampleBits times smaller than
+// the window in entries.
+//
+// The matches of a whole block are found by FindMatchesInBlock before the
+// regular match search of the block, which then asks FindLongestMatch for
+// the match at each position it looks at.
+class HashLongDistance {
+ public:
+  // The minimal length of the matches, and the length of the rolling hash.
+  static const size_t kMinLength = 64;
+
+  HashLongDistance(void) : table_bits_(0), next_match_(0) {
+    remove_mul_ = 1;
+    for (size_t i = 1; i < kMinLength; ++i) {
+      remove_mul_ *= kRollingHashMul;
+    }
+    Reset();
+  }
+
+  void Reset(void) {
+    need_init_ = true;
+  }
+
+  // Sets up the table for a window of lgwin bits, or for the whole stream
+  // if it is known to be at most max_input_size bytes long.
+  void Init(int lgwin, size_t max_input_size) {
+    int table_bits = kMinTableBits;
+    while (table_bits + kSampleBits < lgwin &&
+           (max_input_size == 0 ||
+            (static_cast<size_t>(1) << (table_bits + kSampleBits)) <
+            max_input_size)) {
+      ++table_bits;
+    }
+    if (table_bits != table_bits_ || need_init_) {
+      table_bits_ = table_bits;
+      table_.assign(static_cast<size_t>(1) << table_bits, Entry());
+      need_init_ = false;
+    }
+  }
+
+  // Finds the matches of at least kMinLength bytes starting in the block
+  // [position, position + num_bytes), and stores the sampled positions of
+  // the block in the table. Positions in the last kMinLength - 1 bytes of the
+  // block are sampled with the next block.
+  void FindMatchesInBlock(const size_t num_bytes,
+                          const size_t position,
+                          const uint8_t* ringbuffer,
+                          const size_t ringbuffer_mask,
+                          const size_t max_backward) {
+    matches_.clear();
+    next_match_ = 0;
+    const size_t block_end = position + num_bytes;
+    size_t pos = position >= kMinLength - 1 ? position - (kMinLength - 1) : 0;
+    if (pos + kMinLength > block_end) {
+      return;
+    }
+    uint32_t h = 0;
+    for (size_t i = 0; i < kMinLength; ++i) {
+      h = h * kRollingHashMul + ringbuffer[(pos + i) & ringbuffer_mask] + 1;
+    }
+    // Matches are only searched from where the previous one ends.
+    size_t covered_end = position;
+    for (;;) {
+      const uint32_t mixed = h * kHashMul32;
+      if ((mixed >> (32 - kSampleBits)) == 0) {
+        Entry* entry = &table_[(mixed >> (32 - kSampleBits - table_bits_)) &
+                               ((1u << table_bits_) - 1)];
+        if (pos >= covered_end && entry->hash == h && entry->pos < pos &&
+            pos - entry->pos <= max_backward) {
+          AddMatch(ringbuffer, ringbuffer_mask, block_end, entry->pos, pos,
+                   &covered_end);
+        }
+        entry->hash = h;
+        entry->pos = static_cast<uint32_t>(pos);
+      }
+      if (pos + kMinLength >= block_end) {
+        break;
+      }
+      h = (h - (ringbuffer[pos & ringbuffer_mask] + 1u) * remove_mul_) *
+          kRollingHashMul + ringbuffer[(pos + kMinLength) & ringbuffer_mask] +
+          1;
+      ++pos;
+    }
+  }
+
+  // Looks up the match found by FindMatchesInBlock that covers cur_ix, and
+  // if its rest from cur_ix has a better score than *best_score_out, writes
+  // its length, distance and score into the output parameters.
+  //
+  // Must be called with increasing cur_ix positions.
+  bool FindLongestMatch(const size_t cur_ix,
+                        const size_t max_backward,
+                        size_t * __restrict best_len_out,
+                        size_t * __restrict best_len_code_out,
+                        size_t * __restrict best_distance_out,
+                        double * __restrict best_score_out) {
+    while (next_match_ < matches_.size() &&
+           matches_[next_match_].end <= cur_ix) {
+      ++next_match_;
+    }
+    if (next_match_ == matches_.size() ||
+        matches_[next_match_].start > cur_ix) {
+      return false;
+    }
+    const LongMatch& match = matches_[next_match_];
+    const size_t len = match.end - cur_ix;
+    if (match.distance > max_backward || len <= *best_len_out) {
+      return false;
+    }
+    const double score = BackwardReferenceScore(len, match.distance);
+    if (score <= *best_score_out) {
+      return false;
+    }
+    *best_len_out = len;
+    *best_len_code_out = len;
+    *best_distance_out = match.distance;
+    *best_score_out = score;
+    return true;
+  }
+
+ private:
+  struct Entry {
+    Entry(void) : pos(0), hash(0) {}
+    uint32_t pos;
+    uint32_t hash;
+  };
+
+  struct LongMatch {
+    size_t start;
+    size_t end;
+    size_t distance;
+  };
+
+  // Verifies the candidate prev_pos for pos, and extends it forward up to
+  // the end of the block and backward up to *covered_end.
+  void AddMatch(const uint8_t* ringbuffer,
+                const size_t ringbuffer_mask,
+                const size_t block_end,
+                size_t prev_pos,
+                size_t pos,
+                size_t* covered_end) {
+    const size_t len = FindMatchLengthWithLimit(
+        &ringbuffer[prev_pos & ringbuffer_mask],
+        &ringbuffer[pos & ringbuffer_mask], block_end - pos);
+    if (len < kMinLength) {
+      return;
+    }
+    LongMatch match;
+    match.end = pos + len;
+    match.distance = pos - prev_pos;
+    while (pos > *covered_end && prev_pos > 0 &&
+           ringbuffer[(pos - 1) & ringbuffer_mask] ==
+           ringbuffer[(prev_pos - 1) & ringbuffer_mask]) {
+      --pos;
+      --prev_pos;
+    }
+    match.start = pos;
+    matches_.push_back(match);
+    *covered_end = match.end;
+  }
+
+  static const uint32_t kRollingHashMul = 0x9e3779b1;
+  // One in 1 << kSampleBits positions is stored in the table.
+  static const int kSampleBits = 6;
+  static const int kMinTableBits = 10;
+
+  // kRollingHashMul to the power of kMinLength - 1, the factor of the byte
+  // that leaves the rolling hash.
+  uint32_t remove_mul_;
+
+  int table_bits_;
+  std::vector<Entry> table_;
+
+  // The matches of the current block, sorted by position and disjoint.
+  std::vector<LongMatch> matches_;
+  size_t next_match_;
+
+  bool need_init_;
 };
 
 struct Hashers {
@@ -898,7 +1417,11 @@ struct Hashers {
   typedef HashToBinaryTree H10;
 
   Hashers(void) : hash_h2(0), hash_h3(0), hash_h4(0), hash_h5(0),
-                  hash_h6(0), hash_h7(0), hash_h8(0), hash_h9(0), hash_h10(0) {}
+                  hash_h6(0), hash_h7(0), hash_h8(0), hash_h9(0), hash_h10(0),
+                  hash_long_distance(0), zopfli_cost_model(0),
+                  zopfli_nodes(0),
+                  prefetch_buckets(true),
+                  huge_pages(true) {}
 
   ~Hashers(void) {
     delete hash_h2;
@@ -910,23 +1433,109 @@ struct Hashers {
     delete hash_h8;
     delete hash_h9;
     delete hash_h10;
+    delete hash_long_distance;
+    delete zopfli_cost_model;
+    delete zopfli_nodes;
   }
 
+  // Allocates the hasher of the given type. Calling it again for the same
+  // type does not allocate, but resets the hasher, so that it can be reused
+  // for a new stream.
   void Init(int type) {
+    Init(type, 0);
+  }
+
+  // Same as above, but if max_input_size is not 0, the stream is known to
+  // be at most that many bytes long, and the hashers of types 5 to 9 use a
+  // hash table that is no larger than needed for it.
+  void Init(int type, size_t max_input_size) {
     switch (type) {
-      case 2: hash_h2 = new H2; break;
-      case 3: hash_h3 = new H3; break;
-      case 4: hash_h4 = new H4; break;
-      case 5: hash_h5 = new H5; break;
-      case 6: hash_h6 = new H6; break;
-      case 7: hash_h7 = new H7; break;
-      case 8: hash_h8 = new H8; break;
-      case 9: hash_h9 = new H9; break;
-      case 10: hash_h10 = new H10; break;
+      case 2: InitHasher(&hash_h2); break;
+      case 3: InitHasher(&hash_h3); break;
+      case 4: InitHasher(&hash_h4); break;
+      case 5: InitSizedHasher(&hash_h5, max_input_size); break;
+      case 6: InitSizedHasher(&hash_h6, max_input_size); break;
+      case 7: InitSizedHasher(&hash_h7, max_input_size); break;
+      case 8: InitSizedHasher(&hash_h8, max_input_size); break;
+      case 9: InitSizedHasher(&hash_h9, max_input_size); break;
+      case 10: InitTreeHasher(); break;
       default: break;
     }
   }
 
+  template<typename Hasher>
+  void InitHasher(Hasher** hasher) {
+    if (*hasher == NULL) {
+      *hasher = new Hasher;
+    } else {
+      (*hasher)->Reset();
+    }
+  }
+
+  void InitTreeHasher(void) {
+    if (hash_h10 == NULL) {
+      hash_h10 = new H10(huge_pages);
+    } else {
+      hash_h10->Reset();
+    }
+    if (zopfli_cost_model == NULL) {
+      zopfli_cost_model = new ZopfliCostModel;
+    }
+    if (zopfli_nodes == NULL) {
+      zopfli_nodes = new ZopfliNodes;
+    }
+  }
+
+  // Allocates the long distance match finder, which is used together with
+  // the hashers of types 2 to 9 if it is present. Like Init(), calling it
+  // again sets it up for a new stream.
+  void InitLongDistance(int lgwin, size_t max_input_size) {
+    if (hash_long_distance == NULL) {
+      hash_long_distance = new HashLongDistance;
+    } else {
+      hash_long_distance->Reset();
+    }
+    hash_long_distance->Init(lgwin, max_input_size);
+  }
+
+  // The hasher is reallocated if its hash table has a different size than
+  // the one needed for max_input_size.
+  template<typename Hasher>
+  void InitSizedHasher(Hasher** hasher, size_t max_input_size) {
+    const int bucket_bits = Hasher::BucketBitsForInputSize(max_input_size);
+    if (*hasher != NULL && (*hasher)->bucket_bits() != bucket_bits) {
+      delete *hasher;
+      *hasher = NULL;
+    }
+    if (*hasher == NULL) {
+      *hasher = new Hasher(bucket_bits, huge_pages);
+    } else {
+      (*hasher)->Reset();
+    }
+  }
+
+  // Returns the counters of the hasher of the given type since it was last
+  // set up by Init(), or all zeros if there is no such hasher.
+  HasherStats GetStats(int type) const {
+    switch (type) {
+      case 2: return GetHasherStats(hash_h2);
+      case 3: return GetHasherStats(hash_h3);
+      case 4: return GetHasherStats(hash_h4);
+      case 5: return GetHasherStats(hash_h5);
+      case 6: return GetHasherStats(hash_h6);
+      case 7: return GetHasherStats(hash_h7);
+      case 8: return GetHasherStats(hash_h8);
+      case 9: return GetHasherStats(hash_h9);
+      case 10: return GetHasherStats(hash_h10);
+      default: return HasherStats();
+    }
+  }
+
+  template<typename Hasher>
+  static HasherStats GetHasherStats(const Hasher* hasher) {
+    return hasher == NULL ? HasherStats() : hasher->stats();
+  }
+
   template<typename Hasher>
   void WarmupHash(const size_t size, const uint8_t* dict, Hasher* hasher) {
     hasher->Init();
@@ -967,6 +1576,19 @@ struct Hashers {
   H8* hash_h8;
   H9* hash_h9;
   H10* hash_h10;
+  HashLongDistance* hash_long_distance;
+  // The cost model and the nodes of the shortest path search that is used
+  // together with H10, allocated with it.
+  ZopfliCostModel* zopfli_cost_model;
+  ZopfliNodes* zopfli_nodes;
+
+  // If true, CreateBackwardReferences prefetches the hash table entries of
+  // the positions ahead of the current one. Not used by H10.
+  bool prefetch_buckets;
+
+  // If true, the hashers allocated from now on back their large tables with
+  // huge pages, see AllocateLargeTable().
+  bool huge_pages;
 };
 
 }  // namespace brotli
@@ -0,0 +1,106 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+   Distributed under MIT license.
+   See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+*/
+
+// Allocation of the large, long-lived tables of the encoder.
+
+#include "./large_table.h"
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#if defined(MADV_HUGEPAGE)
+#define BROTLI_MAP_LARGE_TABLES
+#endif
+#endif
+
+#include "./types.h"
+
+namespace brotli {
+
+#ifdef BROTLI_MAP_LARGE_TABLES
+
+namespace {
+
+// The mappings span whole huge pages, whether huge pages are used or not,
+// so that FreeLargeTable does not have to know which.
+size_t MappedSize(size_t size) {
+  return (size + kHugePageSize - 1) & ~(kHugePageSize - 1);
+}
+
+void* MapTable(size_t size, bool huge_pages) {
+  const size_t mapped_size = MappedSize(size);
+  // A huge page can only back an aligned range of kHugePageSize bytes, so
+  // one more huge page is mapped than needed, and the mapping is trimmed to
+  // an aligned start.
+  const size_t reserved_size = mapped_size + kHugePageSize;
+  void* reserved = mmap(NULL, reserved_size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (reserved == MAP_FAILED) {
+    throw std::bad_alloc();
+  }
+  uint8_t* start = static_cast<uint8_t*>(reserved);
+  const size_t head = (kHugePageSize -
+      reinterpret_cast<uintptr_t>(start) % kHugePageSize) % kHugePageSize;
+  if (head > 0) {
+    munmap(start, head);
+  }
+  uint8_t* table = start + head;
+  const size_t tail = reserved_size - head - mapped_size;
+  if (tail > 0) {
+    munmap(table + mapped_size, tail);
+  }
+  // If transparent huge pages are disabled, madvise fails and the table
+  // simply stays on regular pages.
+  madvise(table, mapped_size, huge_pages ? MADV_HUGEPAGE : MADV_NOHUGEPAGE);
+  return table;
+}
+
+}  // namespace
+
+void* AllocateLargeTable(size_t size, bool huge_pages) {
+  if (size >= kHugePageSize) {
+    return MapTable(size, huge_pages);
+  }
+  return ::operator new(size);
+}
+
+void FreeLargeTable(void* table, size_t size) {
+  if (table == NULL) {
+    return;
+  }
+  if (size >= kHugePageSize) {
+    munmap(table, MappedSize(size));
+  } else {
+    ::operator delete(table);
+  }
+}
+
+#else  // BROTLI_MAP_LARGE_TABLES
+
+void* AllocateLargeTable(size_t size, bool) {
+  return ::operator new(size);
+}
+
+void FreeLargeTable(void* table, size_t) {
+  ::operator delete(table);
+}
+
+#endif  // BROTLI_MAP_LARGE_TABLES
+
+void* ReallocateLargeTable(void* table, size_t old_size, size_t new_size,
+                           bool huge_pages) {
+  void* new_table = AllocateLargeTable(new_size, huge_pages);
+  if (table != NULL) {
+    memcpy(new_table, table, std::min(old_size, new_size));
+    FreeLargeTable(table, old_size);
+  }
+  return new_table;
+}
+
+}  // namespace brotli
@@ -0,0 +1,42 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+   Distributed under MIT license.
+   See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+*/
+
+// Allocation of the large, long-lived tables of the encoder, i.e. the hash
+// tables and the ring buffer, which are read at random positions.
+
+#ifndef BROTLI_ENC_LARGE_TABLE_H_
+#define BROTLI_ENC_LARGE_TABLE_H_
+
+#include "./types.h"
+
+namespace brotli {
+
+// Size of a huge page on x86-64 and of the smallest table that is mapped
+// separately by AllocateLargeTable.
+static const size_t kHugePageSize = static_cast<size_t>(1) << 21;
+
+// Allocates size bytes of uninitialized memory. On Linux, tables of at least
+// kHugePageSize bytes are mapped separately, aligned to kHugePageSize. If
+// huge_pages is true, the kernel is asked to back them with transparent huge
+// pages, so that random accesses to the table need far fewer TLB entries;
+// if false, they are kept on regular pages. Smaller tables, and all tables
+// on other systems, come from operator new. Like new, throws std::bad_alloc
+// if there is not enough memory.
+void* AllocateLargeTable(size_t size, bool huge_pages);
+
+// Frees a table allocated by AllocateLargeTable() with the same size.
+// Does nothing if table is NULL.
+void FreeLargeTable(void* table, size_t size);
+
+// Allocates a table of new_size bytes, copies the first
+// min(old_size, new_size) bytes of table to it and frees table. If table is
+// NULL, only allocates.
+void* ReallocateLargeTable(void* table, size_t old_size, size_t new_size,
+                           bool huge_pages);
+
+}  // namespace brotli
+
+#endif  // BROTLI_ENC_LARGE_TABLE_H_
@@ -13,6 +13,7 @@
 #include "./context.h"
 #include "./cluster.h"
 #include "./histogram.h"
+#include "./thread_pool.h"
 
 namespace brotli {
 
@@ -25,8 +26,23 @@ void BuildMetaBlock(const uint8_t* ringbuffer,
                     size_t num_commands,
                     ContextType literal_context_mode,
                     MetaBlockSplit* mb) {
+  BuildMetaBlock(ringbuffer, pos, mask, prev_byte, prev_byte2,
+                 cmds, num_commands, literal_context_mode, 1, mb);
+}
+
+void BuildMetaBlock(const uint8_t* ringbuffer,
+                    const size_t pos,
+                    const size_t mask,
+                    uint8_t prev_byte,
+                    uint8_t prev_byte2,
+                    const Command* cmds,
+                    size_t num_commands,
+                    ContextType literal_context_mode,
+                    int num_threads,
+                    MetaBlockSplit* mb) {
   SplitBlock(cmds, num_commands,
              ringbuffer, pos, mask,
+             num_threads,
              &mb->literal_split,
              &mb->command_split,
              &mb->distance_split);
@@ -57,11 +73,13 @@ void BuildMetaBlock(const uint8_t* ringbuffer,
 
   // Histogram ids need to fit in one byte.
   static const size_t kMaxNumberOfHistograms = 256;
+  ThreadPool pool(num_threads);
 
   ClusterHistograms(literal_histograms,
                     1u << kLiteralContextBits,
                     mb->literal_split.num_types,
                     kMaxNumberOfHistograms,
+                    &pool,
                     &mb->literal_histograms,
                     &mb->literal_context_map);
 
@@ -69,6 +87,7 @@ void BuildMetaBlock(const uint8_t* ringbuffer,
                     1u << kDistanceContextBits,
                     mb->distance_split.num_types,
                     kMaxNumberOfHistograms,
+                    &pool,
                     &mb->distance_histograms,
                     &mb->distance_context_map);
 }
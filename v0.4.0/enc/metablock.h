@@ -47,6 +47,20 @@ void BuildMetaBlock(const uint8_t* ringbuffer,
                     ContextType literal_context_mode,
                     MetaBlockSplit* mb);
 
+// Same as above, but does the block splitting and histogram clustering on
+// about num_threads threads.
+// The result does not depend on num_threads.
+void BuildMetaBlock(const uint8_t* ringbuffer,
+                    const size_t pos,
+                    const size_t mask,
+                    uint8_t prev_byte,
+                    uint8_t prev_byte2,
+                    const Command* cmds,
+                    size_t num_commands,
+                    ContextType literal_context_mode,
+                    int num_threads,
+                    MetaBlockSplit* mb);
+
 // Uses a fast greedy block splitter that tries to merge current block with the
 // last or the second last block and does not do any context modeling.
 void BuildMetaBlockGreedy(const uint8_t* ringbuffer,
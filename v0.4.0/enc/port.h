@@ -62,6 +62,13 @@
 #define PREDICT_TRUE(x) (x)
 #endif
 
+// Hints the CPU to load the cache line at address p, without blocking.
+#if defined(__GNUC__)
+#define BROTLI_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define BROTLI_PREFETCH(p)
+#endif
+
 // Portable handling of unaligned loads, stores, and copies.
 // On some platforms, like ARM, the copy functions can be more efficient
 // then a load and a store.
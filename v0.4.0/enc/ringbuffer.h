@@ -9,8 +9,9 @@
 #ifndef BROTLI_ENC_RINGBUFFER_H_
 #define BROTLI_ENC_RINGBUFFER_H_
 
-#include <cstdlib>  /* free, realloc */
+#include <cstring>  /* memcpy */
 
+#include "./large_table.h"
 #include "./port.h"
 #include "./types.h"
 
@@ -25,29 +26,32 @@ namespace brotli {
 // and another copy of the last two bytes:
 //   buffer_[-1] == buffer_[(1 << window_bits) - 1] and
 //   buffer_[-2] == buffer_[(1 << window_bits) - 2].
+// If huge_pages is true, a large buffer is backed by huge pages, see
+// AllocateLargeTable().
 class RingBuffer {
  public:
-  RingBuffer(int window_bits, int tail_bits)
+  RingBuffer(int window_bits, int tail_bits, bool huge_pages)
       : size_(1u << window_bits),
         mask_((1u << window_bits) - 1),
         tail_size_(1u << tail_bits),
         total_size_(size_ + tail_size_),
         cur_size_(0),
         pos_(0),
+        huge_pages_(huge_pages),
         data_(0),
         buffer_(0) {}
 
   ~RingBuffer(void) {
-    free(data_);
+    FreeLargeTable(data_, AllocatedSize(cur_size_));
   }
 
   // Allocates or re-allocates data_ to the given length + plus some slack
   // region before and after. Fills the slack regions with zeros.
   inline void InitBuffer(const uint32_t buflen) {
-    static const size_t kSlackForEightByteHashingEverywhere = 7;
+    data_ = static_cast<uint8_t*>(ReallocateLargeTable(
+        data_, data_ == 0 ? 0 : AllocatedSize(cur_size_),
+        AllocatedSize(buflen), huge_pages_));
     cur_size_ = buflen;
-    data_ = static_cast<uint8_t*>(realloc(
-        data_, 2 + buflen + kSlackForEightByteHashingEverywhere));
     buffer_ = data_ + 2;
     buffer_[-2] = buffer_[-1] = 0;
     for (size_t i = 0; i < kSlackForEightByteHashingEverywhere; ++i) {
@@ -115,6 +119,12 @@ class RingBuffer {
   const uint8_t *start(void) const { return &buffer_[0]; }
 
  private:
+  static const size_t kSlackForEightByteHashingEverywhere = 7;
+
+  static size_t AllocatedSize(const uint32_t buflen) {
+    return 2 + buflen + kSlackForEightByteHashingEverywhere;
+  }
+
   void WriteTail(const uint8_t *bytes, size_t n) {
     const size_t masked_pos = pos_ & mask_;
     if (PREDICT_FALSE(masked_pos < tail_size_)) {
@@ -133,6 +143,7 @@ class RingBuffer {
   uint32_t cur_size_;
   // Position to write in the ring buffer.
   uint32_t pos_;
+  const bool huge_pages_;
   // The actual ring buffer containing the copy of the last two bytes, the data,
   // and the copy of the beginning as a tail.
   uint8_t *data_;
@@ -0,0 +1,210 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+   Distributed under MIT license.
+   See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+*/
+
+// Implementation of the worker thread pool.
+
+#include "./thread_pool.h"
+
+namespace brotli {
+
+ThreadPool::ThreadPool(int num_threads)
+    : num_threads_(num_threads > 1 ? num_threads : 1),
+      num_pending_(0),
+      shutdown_(false) {
+  if (num_threads_ > 1) {
+    workers_.reserve(static_cast<size_t>(num_threads_));
+    for (int i = 0; i < num_threads_; ++i) {
+      workers_.push_back(std::thread(&ThreadPool::WorkerLoop, this));
+    }
+  }
+}
+
+ThreadPool::~ThreadPool(void) {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    shutdown_ = true;
+  }
+  work_available_.notify_all();
+  for (size_t i = 0; i < workers_.size(); ++i) {
+    workers_[i].join();
+  }
+}
+
+void ThreadPool::Schedule(ThreadPoolTask* task) {
+  if (workers_.empty()) {
+    task->Run();
+    return;
+  }
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    queue_.push_back(task);
+    ++num_pending_;
+  }
+  work_available_.notify_one();
+}
+
+void ThreadPool::Wait(void) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (num_pending_ > 0) {
+    work_done_.wait(lock);
+  }
+}
+
+void ThreadPool::WorkerLoop(void) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    while (queue_.empty() && !shutdown_) {
+      work_available_.wait(lock);
+    }
+    if (queue_.empty()) {
+      // Shutting down and nothing is left to do.
+      return;
+    }
+    ThreadPoolTask* task = queue_.front();
+    queue_.pop_front();
+    lock.unlock();
+    task->Run();
+    lock.lock();
+    if (--num_pending_ == 0) {
+      work_done_.notify_all();
+    }
+  }
+}
+
+WorkStealingPool::WorkStealingPool(int num_threads)
+    : num_threads_(num_threads > 1 ? num_threads : 1),
+      num_queued_(0),
+      num_pending_(0),
+      next_queue_(0),
+      shutdown_(false) {
+  if (num_threads_ > 1) {
+    queues_.reserve(static_cast<size_t>(num_threads_));
+    for (int i = 0; i < num_threads_; ++i) {
+      queues_.push_back(new WorkQueue);
+    }
+    // The queues must exist before any worker starts stealing.
+    workers_.reserve(static_cast<size_t>(num_threads_));
+    for (int i = 0; i < num_threads_; ++i) {
+      workers_.push_back(std::thread(&WorkStealingPool::WorkerLoop, this,
+                                     static_cast<size_t>(i)));
+    }
+  }
+}
+
+WorkStealingPool::~WorkStealingPool(void) {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    shutdown_ = true;
+  }
+  work_available_.notify_all();
+  for (size_t i = 0; i < workers_.size(); ++i) {
+    workers_[i].join();
+  }
+  for (size_t i = 0; i < queues_.size(); ++i) {
+    delete queues_[i];
+  }
+}
+
+size_t WorkStealingPool::CurrentWorker(void) const {
+  const std::thread::id id = std::this_thread::get_id();
+  for (size_t i = 0; i < workers_.size(); ++i) {
+    if (workers_[i].get_id() == id) {
+      return i;
+    }
+  }
+  return workers_.size();
+}
+
+void WorkStealingPool::Schedule(ThreadPoolTask* task) {
+  if (workers_.empty()) {
+    task->Run();
+    return;
+  }
+  size_t queue = CurrentWorker();
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    ++num_queued_;
+    ++num_pending_;
+    if (queue == workers_.size()) {
+      queue = next_queue_;
+      next_queue_ = (next_queue_ + 1) % queues_.size();
+    }
+  }
+  {
+    std::unique_lock<std::mutex> lock(queues_[queue]->mutex);
+    queues_[queue]->tasks.push_back(task);
+  }
+  work_available_.notify_one();
+}
+
+void WorkStealingPool::Wait(void) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (num_pending_ > 0) {
+    work_done_.wait(lock);
+  }
+}
+
+ThreadPoolTask* WorkStealingPool::TakeTask(size_t worker) {
+  {
+    WorkQueue* own = queues_[worker];
+    std::unique_lock<std::mutex> lock(own->mutex);
+    if (!own->tasks.empty()) {
+      ThreadPoolTask* task = own->tasks.back();
+      own->tasks.pop_back();
+      return task;
+    }
+  }
+  for (size_t i = 1; i < queues_.size(); ++i) {
+    WorkQueue* victim = queues_[(worker + i) % queues_.size()];
+    std::unique_lock<std::mutex> lock(victim->mutex);
+    if (!victim->tasks.empty()) {
+      ThreadPoolTask* task = victim->tasks.front();
+      victim->tasks.pop_front();
+      return task;
+    }
+  }
+  return NULL;
+}
+
+void WorkStealingPool::WorkerLoop(size_t worker) {
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      while (num_queued_ == 0 && !shutdown_) {
+        work_available_.wait(lock);
+      }
+      if (num_queued_ == 0) {
+        // Shutting down and nothing is left to do.
+        return;
+      }
+    }
+    // The counter is incremented before the task is pushed, so we may have
+    // to look again until it shows up in one of the queues.
+    ThreadPoolTask* task = TakeTask(worker);
+    if (task == NULL) {
+      std::this_thread::yield();
+      continue;
+    }
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      --num_queued_;
+    }
+    task->Run();
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (--num_pending_ == 0) {
+        work_done_.notify_all();
+      }
+    }
+  }
+}
+
+int DefaultNumThreads(void) {
+  const unsigned int n = std::thread::hardware_concurrency();
+  return n > 0 ? static_cast<int>(n) : 1;
+}
+
+}  // namespace brotli
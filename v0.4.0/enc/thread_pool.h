@@ -0,0 +1,127 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+   Distributed under MIT license.
+   See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+*/
+
+// A fixed-size pool of worker threads used by the parallel compressors.
+
+#ifndef BROTLI_ENC_THREAD_POOL_H_
+#define BROTLI_ENC_THREAD_POOL_H_
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "./types.h"
+
+namespace brotli {
+
+// Unit of work for the thread pool. The pool does not take ownership of the
+// task objects, they must outlive the next ThreadPool::Wait() call.
+class ThreadPoolTask {
+ public:
+  virtual ~ThreadPoolTask(void) {}
+
+  virtual void Run(void) = 0;
+};
+
+// Executes scheduled tasks on num_threads worker threads. Tasks are started
+// in the order they were scheduled, but they may finish in any order.
+// With num_threads <= 1 no threads are created and Schedule() runs the task
+// on the calling thread, which keeps the single-threaded case free of any
+// synchronization overhead.
+class ThreadPool {
+ public:
+  explicit ThreadPool(int num_threads);
+  ~ThreadPool(void);
+
+  int num_threads(void) const { return num_threads_; }
+
+  // Queues the task for execution by the next idle worker.
+  void Schedule(ThreadPoolTask* task);
+
+  // Blocks until every task scheduled so far has finished.
+  void Wait(void);
+
+ private:
+  ThreadPool(const ThreadPool&);
+  ThreadPool& operator=(const ThreadPool&);
+
+  void WorkerLoop(void);
+
+  const int num_threads_;
+  std::vector<std::thread> workers_;
+  std::mutex mutex_;
+  // Signalled when a task is queued or the pool is shutting down.
+  std::condition_variable work_available_;
+  // Signalled when the last running task finishes.
+  std::condition_variable work_done_;
+  std::deque<ThreadPoolTask*> queue_;
+  // Number of tasks that are queued or running.
+  size_t num_pending_;
+  bool shutdown_;
+};
+
+// Thread pool for tasks that schedule further tasks, e.g. a task for a large
+// input that splits it into blocks. Every worker has its own queue: tasks
+// scheduled by a worker are pushed to the back of its queue, and it takes the
+// newest task from there, while idle workers steal the oldest tasks from the
+// other queues. Tasks scheduled from outside the pool are dealt out to the
+// queues in turn. With num_threads <= 1 Schedule() runs the task on the
+// calling thread, including the tasks it schedules.
+class WorkStealingPool {
+ public:
+  explicit WorkStealingPool(int num_threads);
+  ~WorkStealingPool(void);
+
+  int num_threads(void) const { return num_threads_; }
+
+  // Queues the task, can be called from a running task.
+  void Schedule(ThreadPoolTask* task);
+
+  // Blocks until every task scheduled so far, including the ones scheduled
+  // by other tasks in the meantime, has finished. Must not be called from a
+  // task of this pool.
+  void Wait(void);
+
+ private:
+  WorkStealingPool(const WorkStealingPool&);
+  WorkStealingPool& operator=(const WorkStealingPool&);
+
+  struct WorkQueue {
+    std::mutex mutex;
+    std::deque<ThreadPoolTask*> tasks;
+  };
+
+  void WorkerLoop(size_t worker);
+  // Returns the index of the worker running on the calling thread, or
+  // num_threads if it is not a worker of this pool.
+  size_t CurrentWorker(void) const;
+  // Takes a task from the worker's own queue, or steals one from another.
+  ThreadPoolTask* TakeTask(size_t worker);
+
+  const int num_threads_;
+  std::vector<std::thread> workers_;
+  std::vector<WorkQueue*> queues_;
+  std::mutex mutex_;
+  std::condition_variable work_available_;
+  std::condition_variable work_done_;
+  // Number of tasks that are scheduled but not taken yet, it is incremented
+  // before a task is pushed to a queue.
+  size_t num_queued_;
+  // Number of tasks that are queued or running.
+  size_t num_pending_;
+  // Queue of the next task scheduled from outside the pool.
+  size_t next_queue_;
+  bool shutdown_;
+};
+
+// Returns the number of hardware threads, or 1 if it can not be determined.
+int DefaultNumThreads(void);
+
+}  // namespace brotli
+
+#endif  // BROTLI_ENC_THREAD_POOL_H_
@@ -0,0 +1,177 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+   Distributed under MIT license.
+   See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+*/
+
+// Histogram based cost model of the zopfli shortest path search.
+
+#ifndef BROTLI_ENC_ZOPFLI_COST_MODEL_H_
+#define BROTLI_ENC_ZOPFLI_COST_MODEL_H_
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#include "./command.h"
+#include "./fast_log.h"
+#include "./literal_cost.h"
+#include "./prefix.h"
+#include "./types.h"
+
+namespace brotli {
+
+static const float kInfinity = std::numeric_limits<float>::infinity();
+
+// Histogram based cost model for zopflification.
+//
+// The model can be set up again for any number of blocks. It only allocates
+// memory when a block is longer than all blocks before, so an instance is
+// kept with the state of the compressor rather than created for each block.
+class ZopfliCostModel {
+ public:
+  ZopfliCostModel(void) : min_cost_cmd_(kInfinity) {}
+
+  void SetFromCommands(size_t num_bytes,
+                       size_t position,
+                       const uint8_t* ringbuffer,
+                       size_t ringbuffer_mask,
+                       const Command* commands,
+                       size_t num_commands,
+                       size_t last_insert_len) {
+    uint32_t histogram_literal[256];
+    uint32_t histogram_cmd[kNumCommandPrefixes];
+    uint32_t histogram_dist[kNumDistancePrefixes];
+    memset(histogram_literal, 0, sizeof(histogram_literal));
+    memset(histogram_cmd, 0, sizeof(histogram_cmd));
+    memset(histogram_dist, 0, sizeof(histogram_dist));
+
+    size_t pos = position - last_insert_len;
+    for (size_t i = 0; i < num_commands; i++) {
+      size_t inslength = commands[i].insert_len_;
+      size_t copylength = commands[i].copy_len();
+      size_t distcode = commands[i].dist_prefix_;
+      size_t cmdcode = commands[i].cmd_prefix_;
+
+      histogram_cmd[cmdcode]++;
+      if (cmdcode >= 128) histogram_dist[distcode]++;
+
+      // The literals are counted in the pieces of the insert that do not wrap
+      // around the end of the ring buffer.
+      size_t j = 0;
+      while (j < inslength) {
+        const size_t start = (pos + j) & ringbuffer_mask;
+        const size_t len = std::min(inslength - j, ringbuffer_mask + 1 - start);
+        const uint8_t* literals = &ringbuffer[start];
+        for (size_t k = 0; k < len; ++k) {
+          histogram_literal[literals[k]]++;
+        }
+        j += len;
+      }
+
+      pos += inslength + copylength;
+    }
+
+    float cost_literal[256];
+    Set(histogram_literal, 256, cost_literal);
+    Set(histogram_cmd, kNumCommandPrefixes, cost_cmd_);
+    Set(histogram_dist, kNumDistancePrefixes, cost_dist_);
+
+    min_cost_cmd_ = kInfinity;
+    for (uint32_t i = 0; i < kNumCommandPrefixes; ++i) {
+      min_cost_cmd_ = std::min(min_cost_cmd_, cost_cmd_[i]);
+    }
+
+    literal_costs_.resize(num_bytes + 1);
+    literal_costs_[0] = 0.0;
+    size_t i = 0;
+    while (i < num_bytes) {
+      const size_t start = (position + i) & ringbuffer_mask;
+      const size_t len = std::min(num_bytes - i, ringbuffer_mask + 1 - start);
+      const uint8_t* literals = &ringbuffer[start];
+      float* costs = &literal_costs_[i];
+      for (size_t k = 0; k < len; ++k) {
+        costs[k + 1] = costs[k] + cost_literal[literals[k]];
+      }
+      i += len;
+    }
+  }
+
+  void SetFromLiteralCosts(size_t num_bytes,
+                           size_t position,
+                           const uint8_t* ringbuffer,
+                           size_t ringbuffer_mask) {
+    literal_costs_.resize(num_bytes + 2);
+    EstimateBitCostsForLiterals(position, num_bytes, ringbuffer_mask,
+                                ringbuffer, &literal_costs_[1]);
+    literal_costs_[0] = 0.0;
+    for (size_t i = 0; i < num_bytes; ++i) {
+      literal_costs_[i + 1] += literal_costs_[i];
+    }
+    for (uint32_t i = 0; i < kNumCommandPrefixes; ++i) {
+      cost_cmd_[i] = static_cast<float>(FastLog2(11 + i));
+    }
+    for (uint32_t i = 0; i < kNumDistancePrefixes; ++i) {
+      cost_dist_[i] = static_cast<float>(FastLog2(20 + i));
+    }
+    min_cost_cmd_ = static_cast<float>(FastLog2(11));
+  }
+
+  float GetCommandCost(
+      size_t dist_code, size_t length_code, size_t insert_length) const {
+    uint16_t inscode = GetInsertLengthCode(insert_length);
+    uint16_t copycode = GetCopyLengthCode(length_code);
+    uint16_t cmdcode = CombineLengthCodes(inscode, copycode, dist_code == 0);
+    uint16_t dist_symbol;
+    uint32_t distextra;
+    PrefixEncodeCopyDistance(dist_code, 0, 0, &dist_symbol, &distextra);
+    uint32_t distnumextra = distextra >> 24;
+
+    float result = static_cast<float>(
+        GetInsertExtra(inscode) + GetCopyExtra(copycode) + distnumextra);
+    result += cost_cmd_[cmdcode];
+    if (cmdcode >= 128) result += cost_dist_[dist_symbol];
+    return result;
+  }
+
+  float GetLiteralCosts(size_t from, size_t to) const {
+    return literal_costs_[to] - literal_costs_[from];
+  }
+
+  float GetMinCostCmd(void) const {
+    return min_cost_cmd_;
+  }
+
+ private:
+  // Sets cost[0..size) to the Shannon bits of the symbols of the histogram.
+  static void Set(const uint32_t* histogram, size_t size, float* cost) {
+    size_t sum = 0;
+    for (size_t i = 0; i < size; i++) {
+      sum += histogram[i];
+    }
+    float log2sum = static_cast<float>(FastLog2(sum));
+    for (size_t i = 0; i < size; i++) {
+      if (histogram[i] == 0) {
+        cost[i] = log2sum + 2;
+        continue;
+      }
+
+      // Shannon bits for this symbol.
+      cost[i] = log2sum - static_cast<float>(FastLog2(histogram[i]));
+
+      // Cannot be coded with less than 1 bit
+      if (cost[i] < 1) cost[i] = 1;
+    }
+  }
+
+  float cost_cmd_[kNumCommandPrefixes];  // The insert and copy length symbols.
+  float cost_dist_[kNumDistancePrefixes];
+  // Cumulative costs of literals per position in the stream.
+  std::vector<float> literal_costs_;
+  float min_cost_cmd_;
+};
+
+}  // namespace brotli
+
+#endif  // BROTLI_ENC_ZOPFLI_COST_MODEL_H_
@@ -0,0 +1,112 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+
+   Distributed under MIT license.
+   See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+*/
+
+// Nodes of the zopfli shortest path search, one per position of a block.
+
+#ifndef BROTLI_ENC_ZOPFLI_NODE_H_
+#define BROTLI_ENC_ZOPFLI_NODE_H_
+
+#include <algorithm>
+#include <vector>
+
+#include "./types.h"
+#include "./zopfli_cost_model.h"
+
+namespace brotli {
+
+// The last command of the best path found so far to a position.
+struct ZopfliNode {
+  ZopfliNode(void) : length(1),
+                     distance(0),
+                     insert_length(0) {}
+
+  inline uint32_t copy_length() const {
+    return length & 0xffffff;
+  }
+
+  inline uint32_t length_code() const {
+    const uint32_t modifier = length >> 24;
+    return copy_length() + 9u - modifier;
+  }
+
+  inline uint32_t copy_distance() const {
+    return distance & 0x1ffffff;
+  }
+
+  inline uint32_t distance_code() const {
+    const uint32_t short_code = distance >> 25;
+    return short_code == 0 ? copy_distance() + 15 : short_code - 1;
+  }
+
+  inline uint32_t command_length() const {
+    return copy_length() + insert_length;
+  }
+
+  // best length to get up to this byte (not including this byte itself)
+  // highest 8 bit is used to reconstruct the length code
+  uint32_t length;
+  // distance associated with the length
+  // highest 7 bit contains distance short code + 1 (or zero if no short code)
+  uint32_t distance;
+  // number of literal inserts before this copy
+  uint32_t insert_length;
+};
+
+// The nodes of the positions 0..num_bytes of a block.
+//
+// The costs are kept apart from the commands: the search compares the costs
+// of many positions ahead for every position, while the commands are only
+// written when a cost improves and read back when the path is reconstructed.
+// The commands of unreached positions are never read, so only the costs are
+// cleared for a new block. Like ZopfliCostModel, an instance only allocates
+// memory when a block is longer than all blocks before.
+class ZopfliNodes {
+ public:
+  // Marks the positions 1..num_bytes as unreached, and position 0 as the
+  // start of the path.
+  void Init(size_t num_bytes) {
+    if (costs_.size() < num_bytes + 1) {
+      costs_.resize(num_bytes + 1);
+      nodes_.resize(num_bytes + 1);
+    }
+    std::fill(costs_.begin() + 1, costs_.begin() + num_bytes + 1, kInfinity);
+    costs_[0] = 0;
+    nodes_[0] = ZopfliNode();
+    nodes_[0].length = 0;
+  }
+
+  // Smallest cost to get to the position from the beginning, as found so
+  // far, or kInfinity if the position was not reached.
+  float cost(size_t pos) const {
+    return costs_[pos];
+  }
+
+  const ZopfliNode& operator[](size_t pos) const {
+    return nodes_[pos];
+  }
+
+  // Makes a copy of len bytes from pos, after the literals from start_pos,
+  // the best command to get to pos + len.
+  // REQUIRES: len >= 2, start_pos <= pos
+  // REQUIRES: cost < kInfinity, cost(start_pos) < kInfinity
+  // Maintains the "ZopfliNode array invariant".
+  void Update(size_t pos, size_t start_pos, size_t len, size_t len_code,
+              size_t dist, size_t short_code, float cost) {
+    ZopfliNode& next = nodes_[pos + len];
+    next.length = static_cast<uint32_t>(len | ((len + 9u - len_code) << 24));
+    next.distance = static_cast<uint32_t>(dist | (short_code << 25));
+    next.insert_length = static_cast<uint32_t>(pos - start_pos);
+    costs_[pos + len] = cost;
+  }
+
+ private:
+  std::vector<float> costs_;
+  std::vector<ZopfliNode> nodes_;
+};
+
+}  // namespace brotli
+
+#endif  // BROTLI_ENC_ZOPFLI_NODE_H_
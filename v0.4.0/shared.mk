@@ -10,4 +10,4 @@ ifeq ($(OS), Darwin)
 endif
 
 CFLAGS += $(COMMON_FLAGS) -Wmissing-prototypes
-CXXFLAGS += $(COMMON_FLAGS) -Wmissing-declarations
+CXXFLAGS += $(COMMON_FLAGS) -Wmissing-declarations -pthread
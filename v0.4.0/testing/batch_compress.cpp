@@ -0,0 +1,234 @@
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include "encode.h"
+#include "encode_parallel.h"
+#include "thread_pool.h"
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <cstring>
+
+// Compresses every file of a directory in one process with
+// brotli::BrotliCompressBatch and appends one row per file to the same CSV
+// report that sh_scripts/compression_suite.sh writes.
+
+const char* kReportHeader = "Original File Name,File Size(B),Compression Level,Window Bits,Time Taken by Brotli(s),Time Taken in Compression(s),Compressed File Size(B),Compression Ratio,CPU Usage by Compression Process(%),Maximum Resident Size(B)";
+
+struct InputFile {
+    std::string path;
+    std::string name;
+    size_t size;
+};
+
+double Now() {
+    struct timeval t;
+    gettimeofday(&t, nullptr);
+    return t.tv_sec + t.tv_usec / 1e6;
+}
+
+long MaxResidentBytes() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+    return usage.ru_maxrss;
+#else
+    return usage.ru_maxrss * 1024;
+#endif
+}
+
+bool ListFiles(const std::string& directory, std::vector<InputFile>* files) {
+    DIR* dir = opendir(directory.c_str());
+    if (dir == nullptr) {
+        return false;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        InputFile file;
+        file.name = entry->d_name;
+        file.path = directory + "/" + file.name;
+        struct stat stat_buf;
+        if (stat(file.path.c_str(), &stat_buf) != 0 || !S_ISREG(stat_buf.st_mode)) {
+            continue;
+        }
+        file.size = stat_buf.st_size;
+        files->push_back(file);
+    }
+    closedir(dir);
+    std::sort(files->begin(), files->end(),
+              [](const InputFile& a, const InputFile& b) { return a.name < b.name; });
+    return true;
+}
+
+bool ReadFile(const std::string& path, std::vector<uint8_t>* data) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in.is_open()) {
+        return false;
+    }
+    in.seekg(0, std::ios::end);
+    data->resize(in.tellg());
+    in.seekg(0, std::ios::beg);
+    if (!data->empty()) {
+        in.read(reinterpret_cast<char*>(&(*data)[0]), data->size());
+    }
+    return !in.bad();
+}
+
+bool WriteFile(const std::string& path, const std::vector<uint8_t>& data) {
+    std::ofstream out(path, std::ios::binary);
+    if (!out.is_open()) {
+        return false;
+    }
+    out.write(reinterpret_cast<const char*>(data.data()), data.size());
+    return !out.bad();
+}
+
+void PrintUsage() {
+    std::cout << "Usage: batch_compress -d <directory> -c <compression_quality> -w <window_bits> [-t <threads>] [-o <output_dir>] [-b <batch_megabytes>]\n"
+              << "  -d <directory>              : Directory of the input files\n"
+              << "  -c <compression_quality>    : Compression quality (0 to 11)\n"
+              << "  -w <window_bits>            : Number of window bits (10 to 24)\n"
+              << "  -t <threads>                : Number of worker threads (default: all cores)\n"
+              << "  -o <output_dir>             : Directory of the .br files and the report\n"
+              << "                                (default: <directory>_compressed_c<quality>_w<window_bits>)\n"
+              << "  -b <batch_megabytes>        : Input bytes kept in memory at once (default: 1024)\n";
+}
+
+int main(int argc, char* argv[]) {
+    std::string directory;
+    std::string output_dir;
+    int compression_quality = 6;
+    int window_bits = 16;
+    int num_threads = brotli::DefaultNumThreads();
+    size_t batch_bytes = size_t(1024) << 20;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "d:c:w:t:o:b:")) != -1) {
+        switch (opt) {
+            case 'd':
+                directory = optarg;
+                break;
+            case 'c':
+                compression_quality = std::stoi(optarg);
+                break;
+            case 'w':
+                window_bits = std::stoi(optarg);
+                break;
+            case 't':
+                num_threads = std::stoi(optarg);
+                break;
+            case 'o':
+                output_dir = optarg;
+                break;
+            case 'b':
+                batch_bytes = size_t(std::stoul(optarg)) << 20;
+                break;
+            default:
+                PrintUsage();
+                return 1;
+        }
+    }
+    if (directory.empty()) {
+        PrintUsage();
+        return 1;
+    }
+    while (directory.size() > 1 && directory[directory.size() - 1] == '/') {
+        directory.erase(directory.size() - 1);
+    }
+    if (output_dir.empty()) {
+        output_dir = directory + "_compressed_c" + std::to_string(compression_quality) +
+                     "_w" + std::to_string(window_bits);
+    }
+
+    std::vector<InputFile> files;
+    if (!ListFiles(directory, &files)) {
+        std::cerr << "Directory " << directory << " does not exist.\n";
+        return 1;
+    }
+    mkdir(output_dir.c_str(), 0755);
+
+    std::string report_file = output_dir + "/_report_c" + std::to_string(compression_quality) +
+                              "_w" + std::to_string(window_bits) + ".csv";
+    struct stat report_stat;
+    bool write_header = stat(report_file.c_str(), &report_stat) != 0;
+    std::ofstream report(report_file, std::ios::app);
+    if (!report.is_open()) {
+        std::cerr << "Error opening report file: " << report_file << std::endl;
+        return 1;
+    }
+    if (write_header) {
+        report << kReportHeader << "\n";
+    }
+
+    brotli::BrotliParams params;
+    params.quality = compression_quality;
+    params.lgwin = window_bits;
+
+    int failed = 0;
+    // The files are compressed in batches of about batch_bytes input bytes,
+    // so that the whole directory does not have to fit in memory.
+    for (size_t first = 0; first < files.size(); ) {
+        size_t last = first;
+        size_t total_bytes = 0;
+        while (last < files.size() && (last == first || total_bytes + files[last].size <= batch_bytes)) {
+            total_bytes += files[last].size;
+            ++last;
+        }
+
+        std::vector<std::vector<uint8_t> > inputs(last - first);
+        std::vector<bool> read_ok(last - first);
+        std::vector<double> io_seconds(last - first);
+        std::vector<brotli::BrotliBatchItem> items(last - first);
+        for (size_t i = 0; i < items.size(); ++i) {
+            double start = Now();
+            read_ok[i] = ReadFile(files[first + i].path, &inputs[i]);
+            if (!read_ok[i]) {
+                std::cerr << "Error reading input file: " << files[first + i].path << std::endl;
+                inputs[i].clear();
+            }
+            io_seconds[i] = Now() - start;
+            items[i].input_size = inputs[i].size();
+            items[i].input_buffer = inputs[i].empty() ? nullptr : &inputs[i][0];
+        }
+
+        brotli::BrotliCompressBatch(params, &items, num_threads);
+
+        for (size_t i = 0; i < items.size(); ++i) {
+            const InputFile& file = files[first + i];
+            const brotli::BrotliBatchItem& item = items[i];
+            if (!read_ok[i]) {
+                ++failed;
+                continue;
+            }
+            if (!item.ok) {
+                std::cerr << "Error compressing " << file.path << std::endl;
+                ++failed;
+                continue;
+            }
+            double start = Now();
+            if (!WriteFile(output_dir + "/" + file.name + ".br", item.output)) {
+                std::cerr << "Error writing output file for " << file.path << std::endl;
+                ++failed;
+                continue;
+            }
+            io_seconds[i] += Now() - start;
+
+            double compression_ratio = static_cast<double>(item.input_size) / item.output.size();
+            double cpu_usage = item.compression_seconds > 0 ?
+                100.0 * item.cpu_seconds / item.compression_seconds : 0.0;
+            report << file.name << "," << item.input_size << "," << compression_quality << ","
+                   << window_bits << "," << item.compression_seconds << ","
+                   << item.compression_seconds + io_seconds[i] << "," << item.output.size() << ","
+                   << compression_ratio << "," << cpu_usage << "," << MaxResidentBytes() << "\n";
+        }
+        first = last;
+    }
+
+    std::cout << "Compressed " << files.size() - failed << " of " << files.size()
+              << " files. Report is available in " << report_file << "." << std::endl;
+    return failed == 0 ? 0 : 1;
+}
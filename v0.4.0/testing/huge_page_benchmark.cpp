@@ -0,0 +1,217 @@
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include "encode.h"
+#include <unistd.h>
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+// Compares the compression time and the number of dTLB load misses with and
+// without huge pages for the hash tables and the ring buffer
+// (BrotliParams::use_huge_pages) for every quality of a range, and checks
+// that both produce the same output. The dTLB misses are counted with
+// perf_event_open on Linux, and reported as -1 where that is not available.
+
+bool ReadFile(const std::string& path, std::vector<uint8_t>* data) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in.is_open()) {
+        return false;
+    }
+    in.seekg(0, std::ios::end);
+    data->resize(in.tellg());
+    in.seekg(0, std::ios::beg);
+    if (!data->empty()) {
+        in.read(reinterpret_cast<char*>(&(*data)[0]), data->size());
+    }
+    return !in.bad();
+}
+
+// Counts the dTLB load misses of the calling thread between Start() and
+// Stop().
+class TlbMissCounter {
+public:
+    TlbMissCounter() : fd_(-1) {
+#if defined(__linux__)
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                      (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd_ = static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+#endif
+    }
+
+    ~TlbMissCounter() {
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+    }
+
+    bool available() const { return fd_ >= 0; }
+
+    void Start() {
+#if defined(__linux__)
+        if (fd_ >= 0) {
+            ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    // Returns the number of misses since Start(), or -1 if they can not be
+    // counted.
+    long long Stop() {
+        long long count = -1;
+#if defined(__linux__)
+        if (fd_ >= 0) {
+            ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(fd_, &count, sizeof(count)) != sizeof(count)) {
+                count = -1;
+            }
+        }
+#endif
+        return count;
+    }
+
+private:
+    int fd_;
+};
+
+// Returns the fastest of the given number of runs in seconds, or a negative
+// value if the compression failed. Sets *tlb_misses to the dTLB misses of the
+// fastest run.
+double TimeCompression(const brotli::BrotliParams& params, const std::vector<uint8_t>& input,
+                       int runs, TlbMissCounter* counter, long long* tlb_misses,
+                       std::vector<uint8_t>* output) {
+    double best = -1.0;
+    for (int run = 0; run < runs; ++run) {
+        output->resize(input.size() + (input.size() >> 2) + 1024);
+        size_t output_size = output->size();
+        counter->Start();
+        auto start = std::chrono::steady_clock::now();
+        int ok = brotli::BrotliCompressBuffer(params, input.size(), input.data(),
+                                              &output_size, &(*output)[0]);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        long long misses = counter->Stop();
+        if (!ok) {
+            return -1.0;
+        }
+        output->resize(output_size);
+        if (best < 0 || elapsed.count() < best) {
+            best = elapsed.count();
+            *tlb_misses = misses;
+        }
+    }
+    return best;
+}
+
+std::string TransparentHugePageMode() {
+    std::ifstream in("/sys/kernel/mm/transparent_hugepage/enabled");
+    std::string mode;
+    if (!in.is_open() || !std::getline(in, mode)) {
+        return "unknown";
+    }
+    return mode;
+}
+
+void PrintUsage() {
+    std::cout << "Usage: huge_page_benchmark -f <file_path> [-c <min_quality>] [-C <max_quality>] [-w <window_bits>] [-r <runs>]\n"
+              << "  -f <file_path>              : Path to the input file\n"
+              << "  -c <min_quality>            : Lowest compression quality (default: 5)\n"
+              << "  -C <max_quality>            : Highest compression quality (default: 11)\n"
+              << "  -w <window_bits>            : Number of window bits (default: 24)\n"
+              << "  -r <runs>                   : Runs per setting, the fastest is reported (default: 3)\n";
+}
+
+int main(int argc, char* argv[]) {
+    std::string file_path;
+    int min_quality = 5;
+    int max_quality = 11;
+    int window_bits = 24;
+    int runs = 3;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "f:c:C:w:r:")) != -1) {
+        switch (opt) {
+            case 'f':
+                file_path = optarg;
+                break;
+            case 'c':
+                min_quality = std::stoi(optarg);
+                break;
+            case 'C':
+                max_quality = std::stoi(optarg);
+                break;
+            case 'w':
+                window_bits = std::stoi(optarg);
+                break;
+            case 'r':
+                runs = std::max(1, std::stoi(optarg));
+                break;
+            default:
+                PrintUsage();
+                return 1;
+        }
+    }
+    if (file_path.empty()) {
+        PrintUsage();
+        return 1;
+    }
+
+    std::vector<uint8_t> input;
+    if (!ReadFile(file_path, &input)) {
+        std::cerr << "Error reading input file: " << file_path << std::endl;
+        return 1;
+    }
+
+    TlbMissCounter counter;
+    std::cerr << "Transparent huge pages: " << TransparentHugePageMode() << "\n";
+    if (!counter.available()) {
+        std::cerr << "dTLB misses can not be counted on this system.\n";
+    }
+    std::cout << "Quality,Window Bits,File Size(B),Compressed File Size(B),"
+              << "Time without Huge Pages(s),Time with Huge Pages(s),Speedup,"
+              << "dTLB Misses without Huge Pages,dTLB Misses with Huge Pages\n";
+    int failed = 0;
+    for (int quality = min_quality; quality <= max_quality; ++quality) {
+        brotli::BrotliParams params;
+        params.quality = quality;
+        params.lgwin = window_bits;
+        std::vector<uint8_t> plain_output;
+        std::vector<uint8_t> huge_output;
+        long long plain_misses = -1;
+        long long huge_misses = -1;
+        params.use_huge_pages = false;
+        double plain_seconds = TimeCompression(params, input, runs, &counter, &plain_misses,
+                                               &plain_output);
+        params.use_huge_pages = true;
+        double huge_seconds = TimeCompression(params, input, runs, &counter, &huge_misses,
+                                              &huge_output);
+        if (plain_seconds < 0 || huge_seconds < 0) {
+            std::cerr << "Error compressing at quality " << quality << std::endl;
+            ++failed;
+            continue;
+        }
+        if (plain_output != huge_output) {
+            std::cerr << "Different output with huge pages at quality " << quality << std::endl;
+            ++failed;
+        }
+        std::cout << quality << "," << window_bits << "," << input.size() << ","
+                  << huge_output.size() << "," << plain_seconds << "," << huge_seconds << ","
+                  << plain_seconds / huge_seconds << "," << plain_misses << ","
+                  << huge_misses << "\n";
+    }
+    return failed == 0 ? 0 : 1;
+}
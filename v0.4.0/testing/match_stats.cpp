@@ -0,0 +1,153 @@
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include "encode.h"
+#include <unistd.h>
+
+// Prints the match-finder counters of BrotliCompressor::stats() for every
+// quality of a range as CSV, and with -m also the literals and commands of
+// each meta-block. With -b, quality 10 and 11 run with a time budget for the
+// shortest path search, and the input blocks searched like quality 9 after
+// it was exceeded are counted.
+
+bool ReadFile(const std::string& path, std::vector<uint8_t>* data) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in.is_open()) {
+        return false;
+    }
+    in.seekg(0, std::ios::end);
+    data->resize(in.tellg());
+    in.seekg(0, std::ios::beg);
+    if (!data->empty()) {
+        in.read(reinterpret_cast<char*>(&(*data)[0]), data->size());
+    }
+    return !in.bad();
+}
+
+// Compresses the input with a BrotliCompressor, one input block at a time
+// like BrotliCompress() does, and returns the compressed size, or -1 if the
+// compression failed.
+long long Compress(const brotli::BrotliParams& params, const std::vector<uint8_t>& input,
+                   brotli::BrotliCompressorStats* stats) {
+    brotli::BrotliCompressor compressor(params);
+    const size_t block_size = compressor.input_block_size();
+    size_t pos = 0;
+    long long compressed_size = 0;
+    bool is_last = false;
+    while (!is_last) {
+        const size_t size = std::min(block_size, input.size() - pos);
+        compressor.CopyInputToRingBuffer(size, input.data() + pos);
+        pos += size;
+        is_last = pos == input.size();
+        size_t out_size = 0;
+        uint8_t* output = nullptr;
+        if (!compressor.WriteBrotliData(is_last, false, &out_size, &output)) {
+            return -1;
+        }
+        compressed_size += out_size;
+    }
+    *stats = compressor.stats();
+    return compressed_size;
+}
+
+void PrintUsage() {
+    std::cout << "Usage: match_stats -f <file_path> [-c <min_quality>] [-C <max_quality>] [-w <window_bits>] [-b <budget_ms>] [-m]\n"
+              << "  -f <file_path>              : Path to the input file\n"
+              << "  -c <min_quality>            : Lowest compression quality (default: 2)\n"
+              << "  -C <max_quality>            : Highest compression quality (default: 11)\n"
+              << "  -w <window_bits>            : Number of window bits (default: 22)\n"
+              << "  -b <budget_ms>              : Time budget of the shortest path search (default: 0, no limit)\n"
+              << "  -m                          : Also print the counts of each meta-block\n";
+}
+
+int main(int argc, char* argv[]) {
+    std::string file_path;
+    int min_quality = 2;
+    int max_quality = 11;
+    int window_bits = 22;
+    int budget_ms = 0;
+    bool print_metablocks = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "f:c:C:w:b:m")) != -1) {
+        switch (opt) {
+            case 'f':
+                file_path = optarg;
+                break;
+            case 'c':
+                min_quality = std::stoi(optarg);
+                break;
+            case 'C':
+                max_quality = std::stoi(optarg);
+                break;
+            case 'w':
+                window_bits = std::stoi(optarg);
+                break;
+            case 'b':
+                budget_ms = std::stoi(optarg);
+                break;
+            case 'm':
+                print_metablocks = true;
+                break;
+            default:
+                PrintUsage();
+                return 1;
+        }
+    }
+    if (file_path.empty()) {
+        PrintUsage();
+        return 1;
+    }
+
+    std::vector<uint8_t> input;
+    if (!ReadFile(file_path, &input)) {
+        std::cerr << "Error reading input file: " << file_path << std::endl;
+        return 1;
+    }
+
+    std::cout << "Quality,Window Bits,File Size(B),Compressed File Size(B),Hash Lookups,"
+              << "Comparisons per Lookup,Dictionary Lookups,Dictionary Matches,Copies,"
+              << "Average Copy Length";
+    for (int i = 0; i < 16; ++i) {
+        std::cout << ",Distance Code " << i;
+    }
+    std::cout << ",Fallback Blocks\n";
+    int failed = 0;
+    for (int quality = min_quality; quality <= max_quality; ++quality) {
+        brotli::BrotliParams params;
+        params.quality = quality;
+        params.lgwin = window_bits;
+        params.zopfli_time_budget_ms = budget_ms;
+        brotli::BrotliCompressorStats stats;
+        long long compressed_size = Compress(params, input, &stats);
+        if (compressed_size < 0) {
+            std::cerr << "Error compressing at quality " << quality << std::endl;
+            ++failed;
+            continue;
+        }
+        double comparisons = stats.num_hash_lookups == 0 ? 0.0 :
+            static_cast<double>(stats.num_hash_comparisons) / stats.num_hash_lookups;
+        double copy_length = stats.num_copies == 0 ? 0.0 :
+            static_cast<double>(stats.total_copy_length) / stats.num_copies;
+        std::cout << quality << "," << window_bits << "," << input.size() << ","
+                  << compressed_size << "," << stats.num_hash_lookups << ","
+                  << comparisons << "," << stats.num_dict_lookups << ","
+                  << stats.num_dict_matches << "," << stats.num_copies << ","
+                  << copy_length;
+        for (int i = 0; i < 16; ++i) {
+            std::cout << "," << stats.num_distance_cache_hits[i];
+        }
+        std::cout << "," << stats.num_fallback_blocks << "\n";
+        if (print_metablocks) {
+            for (size_t i = 0; i < stats.metablocks.size(); ++i) {
+                const brotli::BrotliCompressorStats::MetaBlock& metablock = stats.metablocks[i];
+                std::cout << "  meta-block " << i << ": " << metablock.input_size
+                          << " bytes, " << metablock.num_literals << " literals, "
+                          << metablock.num_commands << " commands\n";
+            }
+        }
+    }
+    return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,128 @@
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <chrono>
+#include "encode.h"
+#include <unistd.h>
+
+// Compares the compression time with and without prefetching of the hash
+// table entries (BrotliParams::prefetch_hash_buckets) for every quality of a
+// range, and checks that both produce the same output.
+
+bool ReadFile(const std::string& path, std::vector<uint8_t>* data) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in.is_open()) {
+        return false;
+    }
+    in.seekg(0, std::ios::end);
+    data->resize(in.tellg());
+    in.seekg(0, std::ios::beg);
+    if (!data->empty()) {
+        in.read(reinterpret_cast<char*>(&(*data)[0]), data->size());
+    }
+    return !in.bad();
+}
+
+// Returns the fastest of the given number of runs in seconds, or a negative
+// value if the compression failed.
+double TimeCompression(const brotli::BrotliParams& params, const std::vector<uint8_t>& input,
+                       int runs, std::vector<uint8_t>* output) {
+    double best = -1.0;
+    for (int run = 0; run < runs; ++run) {
+        output->resize(input.size() + (input.size() >> 2) + 1024);
+        size_t output_size = output->size();
+        auto start = std::chrono::steady_clock::now();
+        int ok = brotli::BrotliCompressBuffer(params, input.size(), input.data(),
+                                              &output_size, &(*output)[0]);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        if (!ok) {
+            return -1.0;
+        }
+        output->resize(output_size);
+        if (best < 0 || elapsed.count() < best) {
+            best = elapsed.count();
+        }
+    }
+    return best;
+}
+
+void PrintUsage() {
+    std::cout << "Usage: prefetch_benchmark -f <file_path> [-c <min_quality>] [-C <max_quality>] [-w <window_bits>] [-r <runs>]\n"
+              << "  -f <file_path>              : Path to the input file\n"
+              << "  -c <min_quality>            : Lowest compression quality (default: 5)\n"
+              << "  -C <max_quality>            : Highest compression quality (default: 9)\n"
+              << "  -w <window_bits>            : Number of window bits (default: 22)\n"
+              << "  -r <runs>                   : Runs per setting, the fastest is reported (default: 5)\n";
+}
+
+int main(int argc, char* argv[]) {
+    std::string file_path;
+    int min_quality = 5;
+    int max_quality = 9;
+    int window_bits = 22;
+    int runs = 5;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "f:c:C:w:r:")) != -1) {
+        switch (opt) {
+            case 'f':
+                file_path = optarg;
+                break;
+            case 'c':
+                min_quality = std::stoi(optarg);
+                break;
+            case 'C':
+                max_quality = std::stoi(optarg);
+                break;
+            case 'w':
+                window_bits = std::stoi(optarg);
+                break;
+            case 'r':
+                runs = std::max(1, std::stoi(optarg));
+                break;
+            default:
+                PrintUsage();
+                return 1;
+        }
+    }
+    if (file_path.empty()) {
+        PrintUsage();
+        return 1;
+    }
+
+    std::vector<uint8_t> input;
+    if (!ReadFile(file_path, &input)) {
+        std::cerr << "Error reading input file: " << file_path << std::endl;
+        return 1;
+    }
+
+    std::cout << "Quality,Window Bits,File Size(B),Compressed File Size(B),"
+              << "Time without Prefetch(s),Time with Prefetch(s),Speedup\n";
+    int failed = 0;
+    for (int quality = min_quality; quality <= max_quality; ++quality) {
+        brotli::BrotliParams params;
+        params.quality = quality;
+        params.lgwin = window_bits;
+        std::vector<uint8_t> plain_output;
+        std::vector<uint8_t> prefetch_output;
+        params.prefetch_hash_buckets = false;
+        double plain_seconds = TimeCompression(params, input, runs, &plain_output);
+        params.prefetch_hash_buckets = true;
+        double prefetch_seconds = TimeCompression(params, input, runs, &prefetch_output);
+        if (plain_seconds < 0 || prefetch_seconds < 0) {
+            std::cerr << "Error compressing at quality " << quality << std::endl;
+            ++failed;
+            continue;
+        }
+        if (plain_output != prefetch_output) {
+            std::cerr << "Different output with prefetching at quality " << quality << std::endl;
+            ++failed;
+        }
+        std::cout << quality << "," << window_bits << "," << input.size() << ","
+                  << prefetch_output.size() << "," << plain_seconds << ","
+                  << prefetch_seconds << "," << plain_seconds / prefetch_seconds << "\n";
+    }
+    return failed == 0 ? 0 : 1;
+}